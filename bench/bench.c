@@ -0,0 +1,160 @@
+/***************************************************************
+* Microbenchmarks of the firmware kernels. The firmware is built
+* with the stubbed USB and runs under the ucsim s51 simulator
+* (or on the board): Timer 0 counts the machine cycles of each
+* kernel and the results are printed to the serial port.
+*
+* Output: kernel name, cycles per call, cycles per byte.
+****************************************************************/
+
+#define main firmwareMain
+#include "../src/main.c"
+#undef main
+
+// size of the data processed by the block kernels
+#define BLOCK 64
+
+// the simulator interface (ucsim -I if=xram[0xffff]): 's' stops the simulation
+__xdata __at (0xFFFF) volatile uint8_t simIf;
+
+uint16_t overhead = 0;
+uint8_t failed = 0;
+
+static void printStr(const char* s)
+{
+    while (*s) {
+        putchar(*s++);
+    }
+}
+
+static void printNum(uint16_t n)
+{
+    char buf[6];
+    uint8_t i = 0;
+
+    do {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    } while (n);
+    while (i) {
+        putchar(buf[--i]);
+    }
+}
+
+static void timerStart()
+{
+    TR0 = 0;
+    TL0 = 0;
+    TH0 = 0;
+    TF0 = 0;
+    TR0 = 1;
+}
+
+// machine cycles since timerStart()
+static uint16_t timerStop()
+{
+    TR0 = 0;
+    if (TF0) {
+        failed = 1;
+        return 0xFFFF;
+    }
+    return ((TH0 << 8) | TL0) - overhead;
+}
+
+// prints the line of a kernel processing 'bytes' bytes per call (0: none)
+static void report(const char* name, uint16_t cycles, uint8_t bytes)
+{
+    printStr(name);
+    putchar(' ');
+    printNum(cycles);
+    putchar(' ');
+    printNum(bytes ? cycles / bytes : 0);
+    if (cycles == 0xFFFF) {
+        printStr(" overflow");
+    }
+    putchar('\n');
+}
+
+// the block kernels start at this address of each run
+static void setBlock()
+{
+    addrBank = 0x10;
+    addrH = 0x12;
+    addrL = 0x00;
+    progH = addrH;
+    progL = addrL;
+}
+
+void main()
+{
+    uint16_t t;
+    uint8_t i;
+
+    CfgFsys();
+    setupGPIO();
+    mInitSTDIO();
+    //timer 0: 16 bit mode, counts the machine cycles
+    TMOD = (TMOD & 0xF0) | bT0_M0;
+
+    FLCE = 1;
+    ctrl = CTRL_LED1 | CTRL_WE | CTRL_OE;
+    for (i = 0; i < BLOCK; i++) {
+        rwBuffer[i] = i * 7;
+    }
+
+    // the cost of starting and stopping the timer is subtracted
+    timerStart();
+    overhead = timerStop();
+
+    printStr("# kernel cycles/call cycles/byte\n");
+
+    setBlock();
+    timerStart();
+    setShiftRegsCtrl();
+    t = timerStop();
+    report("setShiftRegsCtrl", t, 0);
+
+    setBlock();
+    timerStart();
+    setShiftRegsAddr();
+    t = timerStop();
+    report("setShiftRegsAddr", t, 0);
+
+    setBlock();
+    timerStart();
+    setShiftRegsAddrLow();
+    t = timerStop();
+    report("setShiftRegsAddrLow", t, 0);
+
+    setBlock();
+    rdLen = BLOCK;
+    P1_DATA_IN;
+    timerStart();
+    readData();
+    t = timerStop();
+    report("readData", t, BLOCK);
+
+    setBlock();
+    wrPos = 0;
+    wrLen = BLOCK;
+    wrStep = 1;
+    timerStart();
+    writeData();
+    t = timerStop();
+    report("writeData", t, BLOCK);
+
+    setBlock();
+    wrPos = 0;
+    wrLen = BLOCK;
+    wrStep = 1;
+    timerStart();
+    writeDataSlow();
+    t = timerStop();
+    report("writeDataSlow", t, BLOCK);
+
+    if (failed) {
+        printStr("# timer overflow\n");
+    }
+    simIf = 's';
+    while (1);
+}
@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# compares the benchmark results with the baseline:
+#   compare.sh baseline.txt bench.out [tolerance in percent]
+# fails when a kernel needs more cycles per call than the baseline allows
+
+if [ ! -f "$1" ]; then
+	echo "no baseline $1: run 'make baseline' first"
+	exit 1
+fi
+
+awk -v tol="${3:-2}" '
+	/^#/ { next }
+	NR == FNR { base[$1] = $2; next }
+	{
+		seen[$1] = 1
+		if (!($1 in base)) {
+			printf "%-20s %8d  (new)\n", $1, $2
+			next
+		}
+		d = base[$1] ? ($2 - base[$1]) * 100.0 / base[$1] : 0
+		bad = $2 > base[$1] * (100 + tol) / 100 || $3 == "overflow"
+		printf "%-20s %8d  baseline %8d  %+6.1f%%%s\n", $1, $2, base[$1], d, bad ? "  REGRESSED" : ""
+		if (bad) {
+			failed = 1
+		}
+	}
+	END {
+		for (k in base) {
+			if (!(k in seen)) {
+				printf "%-20s missing\n", k
+				failed = 1
+			}
+		}
+		exit failed
+	}
+' "$1" "$2"
@@ -0,0 +1,2 @@
+// Stub of the USB descriptors for the firmware benchmarks: the kernels
+// run without USB.
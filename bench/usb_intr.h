@@ -0,0 +1,16 @@
+// Stub of the USB interrupt handlers for the firmware benchmarks. The
+// kernels run without USB: only the symbols used by src/main.c are defined.
+
+#ifndef __USB_INTR_STUB_H__
+#define __USB_INTR_STUB_H__
+
+__xdata __at (0x0000) uint8_t Ep0Buffer[64];
+uint8_t UsbIntrSetupReq;
+
+#define UsbSetupBuf ((PUSB_SETUP_REQ) Ep0Buffer)
+
+static void USBDeviceCfg()
+{
+}
+
+#endif
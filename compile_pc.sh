@@ -1,2 +1,4 @@
-gcc  -o prog_pc src/prog_pc.c -lusb-1.0
+gcc -O2 -o prog_pc src/prog_pc.c src/cf840.c -lusb-1.0 -lpthread || exit 1
 
+# tests of the HEX and S-record loader
+gcc -O2 -o image_test test/image_test.c src/cf840.c -lusb-1.0 -lpthread && ./image_test
@@ -0,0 +1,1589 @@
+/* cf840 - library for the CH55x based 27CF840 programmer
+ *
+ * Copyright (C) 2020 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * USB lib API reference:
+ *     http://libusb.sourceforge.net/api-1.0
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#ifdef MINGW
+#include <libusbx-1.0/libusb.h>
+#else
+#include <libusb-1.0/libusb.h>
+#endif
+
+#include "cf840.h"
+
+#define VENDOR_ID 0x16c0
+#define PRODUCT_ID 0x05dc
+#define VENDOR_NAME "github.com/ole00"
+#define PRODUCT_NAME "27cf840_prog"
+
+//see usb1.1 page 183: value bitmap: Host->Device, Vendor request, Recipient is interface
+#define TYPE_OUT_ITF		0x41
+
+//see usb1.1 page 183: value bitmap: Device->Host, Vendor request, Sender is interface
+#define TYPE_IN_ITF		(0x41 | (1 << 7))
+
+#define COMMAND_GET_DATA  0x40
+#define COMMAND_GET_ID    0x41
+#define COMMAND_GET_TIME  0x42
+#define COMMAND_WRITE     0x50
+#define COMMAND_WRITE_RLE 0x52
+#define COMMAND_READ      0x60
+#define COMMAND_SCRIPT    0x70
+#define COMMAND_GET_CAPS  0x80
+#define COMMAND_SETUP     0xF0
+
+#define SETUP_MANUF_ID 0
+#define SETUP_DEVICE_ID 1
+#define SETUP_VERIFY_PROTECT 2
+#define SETUP_ID_MAP 3
+#define SETUP_ERASE 4
+#define SETUP_SECTOR_ERASE 5
+#define SETUP_READ 6
+#define SETUP_WRITE 7
+#define SETUP_SELF_TEST 8
+#define SETUP_READY 10
+
+// status byte of the firmware
+#define STATUS_ERASE 1
+#define STATUS_ERASE_FAIL 2
+#define STATUS_SCRIPT_FAIL 5
+
+// default timeout of the control transfers in ms
+#define TRANSFER_TIMEOUT 50
+
+// transfers failing on a timeout or I/O error are repeated, the USB device
+// is reset before the last attempt
+#define TRANSFER_RETRIES 3
+
+// the biggest supported flash chip: 20 bit address space
+#define MAX_CHIP_SIZE (1024 * 1024)
+
+// the data of one RLE packet stay within an aligned block of this size,
+// so they never cross a sector boundary (the smallest sector is 8 kbytes)
+#define RLE_BLOCK 4096
+
+// maximum number of 64 byte blocks covered by one compressed read
+#define RLE_READ_BLOCKS 64
+
+// cf840Diff() starts with checksums of aligned ranges up to 2^DIFF_TOP_SHIFT bytes
+#define DIFF_TOP_SHIFT 16
+
+// maximum number of programmers checked by cf840Open()
+#define MAX_DEVICES 16
+
+// asynchronous operations
+#define ASYNC_READ 1
+#define ASYNC_WRITE 2
+#define ASYNC_VERIFY 3
+#define ASYNC_ERASE 4
+
+struct Cf840Context {
+    libusb_context* usb;
+    Cf840LogFn log;
+    void* logUser;
+};
+
+struct Cf840Device {
+    Cf840Context* ctx;
+    libusb_device_handle* h;
+    char path[32];     // bus and port numbers: stable while the board stays in its port
+    char serial[16];   // unique ID of the CH552 MCU
+    uint8_t resBuf[64]; //input (response) buffer
+
+    const Cf840ChipInfo* chip;
+    char chipKnown;
+    int features;      // CF840_FEATURE_* enabled by the application
+    Cf840Capabilities caps;
+    int timeout;       // of the control transfers in ms
+    uint32_t erased[2]; // bitmap of sectors erased by the current write
+
+    Cf840ProgressFn progress;
+    void* progressUser;
+
+    Cf840TimingFn timing;
+    void* timingUser;
+    char timingOff;        // the firmware does not measure the durations
+    uint32_t timingSector; // start of the sector being written, MAX_CHIP_SIZE: none
+
+    // asynchronous operation
+    pthread_t worker;
+    char asyncStarted;
+    int asyncType;
+    int asyncResult;
+    uint32_t asyncAddr;
+    uint8_t* asyncBuf;
+    const uint8_t* asyncData;
+    uint32_t asyncLen;
+    int asyncFlags;
+    uint32_t* asyncBadAddr;
+    Cf840DoneFn asyncDone;
+    void* asyncUser;
+};
+
+static const Cf840ChipInfo chips[] = {
+    { 0xD6, "29F800T", 1024 * 1024, CF840_BOOT_TOP },
+    { 0x58, "29F800B", 1024 * 1024, CF840_BOOT_BOTTOM },
+    { 0x23, "29F400T", 512 * 1024, CF840_BOOT_TOP },
+    { 0xAB, "29F400B", 512 * 1024, CF840_BOOT_BOTTOM },
+    { 0, NULL, 0, 0 }
+};
+
+static void logMsg(Cf840Context* ctx, const char* f, ...)
+{
+    char msg[256];
+    va_list ap;
+
+    if (ctx->log == NULL) {
+        return;
+    }
+    va_start(ap, f);
+    vsnprintf(msg, sizeof(msg), f, ap);
+    va_end(ap);
+    ctx->log(ctx->logUser, msg);
+}
+
+// Requests which only read the firmware state, the chip or the transfer
+// buffer: they can be repeated. Setup (erase, unlock cycles), write and
+// script requests change the chip and are never repeated automatically.
+static int isRetryable(uint8_t command)
+{
+    switch (command & 0xF0) {
+    case COMMAND_GET_DATA:
+    case COMMAND_READ:
+    case COMMAND_GET_CAPS:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Runs the control transfer, repeats the retryable requests on transient
+ * errors. A failed write is resumed by the journal (-resume).
+ * The firmware never executes a stalled request: any request is repeated
+ * once after a stall, as the first request after an aborted write data stage
+ * is stalled. A second stall means the firmware does not support it.
+ */
+static int controlTransfer(Cf840Device* dev, uint8_t type, uint8_t command, uint16_t param1, uint16_t param2, uint8_t* buf, uint16_t len)
+{
+    int attempt = 0;
+    int stalled = 0;
+    int ret;
+
+    while (1) {
+        ret = libusb_control_transfer(dev->h, type, command, param1, param2, buf, len, dev->timeout);
+        if (ret == LIBUSB_ERROR_PIPE && !stalled) {
+            stalled = 1;
+            continue;
+        }
+        if (ret >= 0 || ret == LIBUSB_ERROR_PIPE || ret == LIBUSB_ERROR_NO_DEVICE || !isRetryable(command) ||
+            ++attempt == TRANSFER_RETRIES
+        ) {
+            return ret;
+        }
+        logMsg(dev->ctx, "transfer 0x%02x failed: %s, retrying\n", command, libusb_error_name(ret));
+        // gives the firmware time to finish the request which may have reached it
+        usleep(10 * 1000);
+        if (attempt == TRANSFER_RETRIES - 1) {
+            ret = libusb_reset_device(dev->h);
+            logMsg(dev->ctx, "device reset. result=%i\n", ret);
+            if (ret == LIBUSB_ERROR_NOT_FOUND) {
+                // re-enumerated: the handle is no longer valid
+                return ret;
+            }
+        }
+    }
+}
+
+// sends the data directly from the buffer 'buf'
+static int sendControlTransfer(Cf840Device* dev, uint8_t command, uint16_t param1, uint16_t param2, const uint8_t* buf, uint16_t len) {
+    return controlTransfer(dev, TYPE_OUT_ITF, command, param1, param2, (uint8_t*) buf, len);
+}
+
+// receives the response directly to the buffer 'buf'
+static int recvControlTransfer(Cf840Device* dev, uint8_t command, uint16_t param1, uint16_t param2, uint8_t* buf, uint16_t len) {
+    memset(buf, 0, len);
+    return controlTransfer(dev, TYPE_IN_ITF, command, param1, param2, buf, len);
+}
+
+// sends the setup command: 'op' with the 20 bit address
+static int sendSetup(Cf840Device* dev, uint8_t op, uint32_t addr)
+{
+    int ret = sendControlTransfer(dev, COMMAND_SETUP, addr & 0xFFFF, (op << 8) | ((addr >> 16) & 0xFF), NULL, 0);
+    if (ret != 0) {
+        logMsg(dev->ctx, "setup %i failed. result=%i\n", op, ret);
+        return CF840_ERROR_USB;
+    }
+    return CF840_OK;
+}
+
+// retrieves data and status bytes from the flash IC
+static int getData(Cf840Device* dev)
+{
+    int ret = recvControlTransfer(dev, COMMAND_GET_DATA, 0, 0, dev->resBuf, 2);
+    if (ret != 2) {
+        logMsg(dev->ctx, "get data failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+    return CF840_OK;
+}
+
+// returns 0 when finished, the error state or CF840_ERROR_USB
+static int waitForFlashIoFinish(Cf840Device* dev, int initialDelay, int step, int errorState)
+{
+    usleep(initialDelay);
+    while (1) {
+        if (getData(dev)) {
+            return CF840_ERROR_USB;
+        }
+        if (dev->resBuf[1] == 0) {
+            return 0;
+        }
+        if (errorState != 0 && dev->resBuf[1] == errorState) {
+            return dev->resBuf[1];
+        }
+        usleep(step);
+    }
+}
+
+// formats the port path of the device, for example 1-2.4
+static void getPortPath(libusb_device* usbDev, char* path, int size)
+{
+    uint8_t ports[8];
+    int cnt = libusb_get_port_numbers(usbDev, ports, sizeof(ports));
+    int i, len;
+
+    len = snprintf(path, size, "%i", libusb_get_bus_number(usbDev));
+    for (i = 0; i < cnt && len < size; i++) {
+        len += snprintf(path + len, size - len, "%c%i", i ? '.' : '-', ports[i]);
+    }
+}
+
+// checks whether the port path is in the newline separated list
+static int pathListed(const char* paths, const char* path)
+{
+    int len = strlen(path);
+    const char* s = paths;
+
+    while ((s = strstr(s, path)) != NULL) {
+        if ((s == paths || s[-1] == '\n') && (s[len] == '\n' || s[len] == 0)) {
+            return 1;
+        }
+        s += len;
+    }
+    return 0;
+}
+
+// prepares the opened device for the vendor commands
+static int setupDevice(Cf840Context* ctx, libusb_device_handle* h)
+{
+    int config = 0;
+
+    //try to detach existing kernel driver if kernel is already handling
+    //the device
+    if (libusb_kernel_driver_active(h, 0) == 1) {
+        logMsg(ctx, "kernel driver active\n");
+        if (!libusb_detach_kernel_driver(h, 0)) {
+            logMsg(ctx, "driver detached\n");
+        }
+    }
+
+    //set the first configuration -> initialize USB device.
+    //Setting it again would reset the device state: skip it when already set.
+    if (libusb_get_configuration(h, &config) != 0 || config != 1) {
+        if (libusb_set_configuration (h, 1) != 0) {
+            logMsg(ctx, "cannot set device configuration\n");
+            return -1;
+        }
+        logMsg(ctx, "device configuration set\n");
+    }
+
+    //get the first interface of the USB configuration
+    if (libusb_claim_interface(h, 0) < 0) {
+        logMsg(ctx, "cannot claim interface\n");
+        return -1;
+    }
+    logMsg(ctx, "interface claimed\n");
+
+    if (libusb_set_interface_alt_setting(h, 0, 0) < 0) {
+        logMsg(ctx, "alt setting failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// reads the capabilities of the firmware. Old firmware stalls the request.
+static void getCapabilities(Cf840Device* dev)
+{
+    uint8_t* b = dev->resBuf;
+    int ret = recvControlTransfer(dev, COMMAND_GET_CAPS, 0, 0, b, 8);
+
+    memset(&dev->caps, 0, sizeof(dev->caps));
+    if (ret < 5 || b[0] == 0) {
+        logMsg(dev->ctx, "legacy firmware without capabilities. result=%i\n", ret);
+        return;
+    }
+    dev->caps.protocol = b[0];
+    dev->caps.version = (b[1] << 8) | b[2];
+    dev->caps.blockSize = b[3];
+    dev->caps.buffers = b[4];
+    dev->caps.caps = (ret >= 7) ? b[5] | (b[6] << 8) : 0;
+    logMsg(dev->ctx, "firmware %i.%i protocol %i caps=0x%04x\n", b[1], b[2], b[0], dev->caps.caps);
+}
+
+// Checks the firmware supports the feature. Legacy firmware (protocol 0)
+// does not report its features: it gets only the baseline operations.
+static int hasCap(Cf840Device* dev, int cap)
+{
+    return (dev->caps.caps & cap) != 0;
+}
+
+// reads the unique ID of the CH552 MCU. Old firmware does not support it.
+static void getSerial(Cf840Device* dev)
+{
+    uint8_t* b = dev->resBuf;
+    int ret = recvControlTransfer(dev, COMMAND_GET_ID, 0, 0, b, 4);
+    if (ret == 4) {
+        snprintf(dev->serial, sizeof(dev->serial), "%02X%02X%02X%02X", b[3], b[2], b[1], b[0]);
+    } else {
+        strcpy(dev->serial, "-");
+    }
+}
+
+int cf840Init(Cf840Context** ctx)
+{
+    Cf840Context* c = calloc(1, sizeof(Cf840Context));
+    if (c == NULL) {
+        return CF840_ERROR_NO_MEMORY;
+    }
+    if (libusb_init(&c->usb)) {
+        free(c);
+        return CF840_ERROR_USB;
+    }
+    *ctx = c;
+    return CF840_OK;
+}
+
+void cf840Exit(Cf840Context* ctx)
+{
+    libusb_exit(ctx->usb);
+    free(ctx);
+}
+
+void cf840SetLog(Cf840Context* ctx, Cf840LogFn fn, void* user)
+{
+    ctx->log = fn;
+    ctx->logUser = user;
+}
+
+struct libusb_context* cf840UsbContext(Cf840Context* ctx)
+{
+    return ctx->usb;
+}
+
+/**
+ * Opens the device if it is a programmer: the vendor and product IDs are
+ * shared by many V-USB projects, so the texts must match too.
+ */
+int cf840OpenUsb(Cf840Context* ctx, struct libusb_device* usbDev, Cf840Device** dev)
+{
+    char vendorName[32];
+    char productName[32];
+    struct libusb_device_descriptor des;
+    libusb_device_handle* handle;
+    Cf840Device* d;
+    int ret;
+
+    ret = libusb_get_device_descriptor(usbDev, &des);
+    if (ret || des.idVendor != VENDOR_ID || des.idProduct != PRODUCT_ID) {
+        return CF840_ERROR_NOT_FOUND;
+    }
+
+    //get the device handle in order to get the vendor name and product name
+    ret = libusb_open(usbDev, &handle);
+    if (ret) {
+        logMsg(ctx, "device open failed. result=%i\n", ret);
+        return CF840_ERROR_ACCESS;
+    }
+
+    //retrieve the texts
+    vendorName[0] = 0;
+    libusb_get_string_descriptor_ascii(handle, des.iManufacturer, (uint8_t*) vendorName, sizeof(vendorName));
+    vendorName[sizeof(vendorName) - 1] = 0;
+    productName[0] = 0;
+    libusb_get_string_descriptor_ascii(handle, des.iProduct, (uint8_t*) productName, sizeof(productName));
+    productName[sizeof(productName) - 1] = 0;
+
+    logMsg(ctx, "device vendor=%04x, product=%04x bus:device=%i:%i %s/%s\n",
+            des.idVendor, des.idProduct,
+            libusb_get_bus_number(usbDev),
+            libusb_get_device_address(usbDev),
+            vendorName, productName
+    );
+
+    //ensure the vendor name and product name matches, keep the device open
+    if (
+        strcmp(VENDOR_NAME, vendorName) != 0 ||
+        strcmp(PRODUCT_NAME, productName) != 0
+    ) {
+        libusb_close(handle);
+        return CF840_ERROR_NOT_FOUND;
+    }
+    if (setupDevice(ctx, handle)) {
+        libusb_close(handle);
+        return CF840_ERROR_ACCESS;
+    }
+    d = calloc(1, sizeof(Cf840Device));
+    if (d == NULL) {
+        libusb_release_interface(handle, 0);
+        libusb_close(handle);
+        return CF840_ERROR_NO_MEMORY;
+    }
+    d->ctx = ctx;
+    d->h = handle;
+    d->timeout = TRANSFER_TIMEOUT;
+    getPortPath(usbDev, d->path, sizeof(d->path));
+    getSerial(d);
+    getCapabilities(d);
+    *dev = d;
+    return CF840_OK;
+}
+
+int cf840OpenAll(Cf840Context* ctx, const char* paths, Cf840Device** list, int max)
+{
+    libusb_device** devList = NULL;
+    char path[32];
+    int devCnt;
+    int cnt = 0;
+    int i;
+
+    devCnt = libusb_get_device_list(ctx->usb, &devList);
+    logMsg(ctx, "total USB devices found: %i \n", devCnt);
+    for (i = 0; i < devCnt && cnt < max; i++) {
+        if (paths != NULL) {
+            getPortPath(devList[i], path, sizeof(path));
+            if (!pathListed(paths, path)) {
+                continue;
+            }
+        }
+        if (cf840OpenUsb(ctx, devList[i], &list[cnt]) == CF840_OK) {
+            cnt++;
+        }
+    }
+    if (devCnt >= 0) {
+        libusb_free_device_list(devList, 1);
+    }
+    return cnt;
+}
+
+int cf840Open(Cf840Context* ctx, const char* id, Cf840Device** dev)
+{
+    Cf840Device* list[MAX_DEVICES];
+    int cnt;
+    int i;
+
+    // the port path (always contains '-') is known without opening the other devices
+    cnt = cf840OpenAll(ctx, (id && strchr(id, '-')) ? id : NULL, list, MAX_DEVICES);
+    *dev = NULL;
+    for (i = 0; i < cnt; i++) {
+        if (*dev == NULL && (id == NULL || id[0] == 0 || strcmp(id, list[i]->path) == 0 || strcasecmp(id, list[i]->serial) == 0)) {
+            *dev = list[i];
+        } else {
+            cf840Close(list[i]);
+        }
+    }
+    return *dev ? CF840_OK : CF840_ERROR_NOT_FOUND;
+}
+
+void cf840Close(Cf840Device* dev)
+{
+    if (dev == NULL) {
+        return;
+    }
+    cf840Wait(dev);
+    libusb_release_interface(dev->h, 0);
+    libusb_close(dev->h);
+    free(dev);
+}
+
+const char* cf840Path(Cf840Device* dev)
+{
+    return dev->path;
+}
+
+const char* cf840Serial(Cf840Device* dev)
+{
+    return dev->serial;
+}
+
+struct libusb_device* cf840UsbDevice(Cf840Device* dev)
+{
+    return libusb_get_device(dev->h);
+}
+
+void cf840SetProgress(Cf840Device* dev, Cf840ProgressFn fn, void* user)
+{
+    dev->progress = fn;
+    dev->progressUser = user;
+}
+
+void cf840SetTiming(Cf840Device* dev, Cf840TimingFn fn, void* user)
+{
+    dev->timing = fn;
+    dev->timingUser = user;
+}
+
+void cf840SetTimeout(Cf840Device* dev, int ms)
+{
+    dev->timeout = ms > 0 ? ms : TRANSFER_TIMEOUT;
+}
+
+void cf840SetFeatures(Cf840Device* dev, int features)
+{
+    dev->features = features;
+    if (!hasCap(dev, CF840_CAP_RLE_READ)) {
+        dev->features &= ~CF840_FEATURE_RLE_READ;
+    }
+}
+
+const Cf840Capabilities* cf840GetCapabilities(Cf840Device* dev)
+{
+    return &dev->caps;
+}
+
+static void progress(Cf840Device* dev, int op, uint32_t addr, uint32_t done, uint32_t total)
+{
+    if (dev->progress) {
+        dev->progress(dev->progressUser, op, addr, done, total);
+    }
+}
+
+const Cf840ChipInfo* cf840FindChip(uint8_t deviceId)
+{
+    const Cf840ChipInfo* chip = chips;
+    while (chip->name != NULL && chip->deviceId != deviceId) {
+        chip++;
+    }
+    return chip->name ? chip : NULL;
+}
+
+// size of the self-test result sent by the firmware
+#define SELF_TEST_SIZE 9
+
+int cf840SelfTest(Cf840Device* dev, Cf840SelfTestResult* result)
+{
+    uint8_t* b = dev->resBuf;
+    int ret;
+
+    if (!(dev->caps.caps & CF840_CAP_SELF_TEST)) {
+        return CF840_ERROR_UNSUPPORTED;
+    }
+    ret = sendSetup(dev, SETUP_SELF_TEST, 0);
+    if (ret) {
+        return ret;
+    }
+    // the bus patterns and ~25 reads take a few ms
+    ret = waitForFlashIoFinish(dev, 2000, 1000, 0);
+    if (ret) {
+        return ret;
+    }
+    ret = recvControlTransfer(dev, COMMAND_READ | 1, 0, 0, b, SELF_TEST_SIZE);
+    if (ret != SELF_TEST_SIZE) {
+        logMsg(dev->ctx, "get self-test result failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+    result->flags = b[0];
+    result->dataStuckLow = b[1];
+    result->dataStuckHigh = b[2];
+    result->dataShort = b[3];
+    result->addrSuspect = b[4] | (b[5] << 8) | ((uint32_t) b[6] << 16);
+    result->manufId = b[7];
+    result->deviceId = b[8];
+    if (!(result->flags & CF840_TEST_NO_AUTOSELECT)) {
+        dev->chip = cf840FindChip(result->deviceId);
+        dev->chipKnown = 1;
+    }
+    return CF840_OK;
+}
+
+int cf840ProtectMap(Cf840Device* dev, uint8_t* manufId, uint8_t* deviceId, uint8_t* protect)
+{
+    uint8_t* b = dev->resBuf;
+    int ret;
+
+    // legacy firmware would ignore the request
+    if (!(dev->caps.caps & CF840_CAP_ID_MAP)) {
+        return CF840_ERROR_UNSUPPORTED;
+    }
+    ret = sendSetup(dev, SETUP_ID_MAP, 0);
+    if (ret) {
+        return ret;
+    }
+    // 2 identifications and 128 reads take a few ms
+    ret = waitForFlashIoFinish(dev, 2000, 1000, 0);
+    if (ret) {
+        return ret;
+    }
+    ret = recvControlTransfer(dev, COMMAND_READ | 1, 0, 0, b, 2 + CF840_PROTECT_MAP_SIZE);
+    if (ret != 2 + CF840_PROTECT_MAP_SIZE) {
+        logMsg(dev->ctx, "get protection map failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+    *manufId = b[0];
+    *deviceId = b[1];
+    if (protect) {
+        memcpy(protect, b + 2, CF840_PROTECT_MAP_SIZE);
+    }
+    dev->chip = cf840FindChip(*deviceId);
+    dev->chipKnown = 1;
+    return CF840_OK;
+}
+
+int cf840Identify(Cf840Device* dev, uint8_t* manufId, uint8_t* deviceId)
+{
+    int ret;
+
+    if (dev->caps.caps & CF840_CAP_ID_MAP) {
+        return cf840ProtectMap(dev, manufId, deviceId, NULL);
+    }
+
+    //read Vendor Id
+    ret = sendSetup(dev, SETUP_MANUF_ID, 0);
+    if (ret) {
+        return ret;
+    }
+    usleep(50 * 1000);
+    //read back the value
+    ret = getData(dev);
+    if (ret) {
+        return ret;
+    }
+    *manufId = dev->resBuf[0];
+
+    //read Product Id
+    ret = sendSetup(dev, SETUP_DEVICE_ID, 0);
+    if (ret) {
+        return ret;
+    }
+    usleep(50 * 1000);
+    ret = getData(dev);
+    if (ret) {
+        return ret;
+    }
+    *deviceId = dev->resBuf[0];
+
+    dev->chip = cf840FindChip(*deviceId);
+    dev->chipKnown = 1;
+    return CF840_OK;
+}
+
+const Cf840ChipInfo* cf840GetChip(Cf840Device* dev)
+{
+    uint8_t manufId, deviceId;
+
+    if (!dev->chipKnown) {
+        cf840Identify(dev, &manufId, &deviceId);
+    }
+    return dev->chip;
+}
+
+/**
+ * Finds the sector containing the address 'pos'.
+ * All chips have 64k sectors except the boot block which is split
+ * to 16k, 8k, 8k and 32k sectors (in reversed order for top boot chips).
+ * Returns the sector index and sets the sector start and size.
+ */
+int cf840GetSector(const Cf840ChipInfo* chip, uint32_t pos, uint32_t* start, uint32_t* size)
+{
+    static const uint32_t bootSectors[4] = { 16 * 1024, 8 * 1024, 8 * 1024, 32 * 1024 };
+    uint32_t bootStart = (chip->boot == CF840_BOOT_TOP) ? chip->size - 0x10000 : 0;
+    uint32_t s = bootStart;
+    int i;
+
+    if (pos < bootStart || pos >= bootStart + 0x10000) {
+        *start = pos & ~0xFFFF;
+        *size = 0x10000;
+        // the 4 boot sectors count as 1 extra sector below the top boot block
+        return (pos >> 16) + ((chip->boot == CF840_BOOT_BOTTOM) ? 3 : 0);
+    }
+    for (i = 0; i < 4; i++) {
+        uint32_t len = bootSectors[chip->boot == CF840_BOOT_TOP ? 3 - i : i];
+        if (pos < s + len) {
+            break;
+        }
+        s += len;
+    }
+    *start = s;
+    *size = bootSectors[chip->boot == CF840_BOOT_TOP ? 3 - i : i];
+    return (bootStart >> 16) + i;
+}
+
+/**
+ * Gets the durations measured by the firmware: the last erase (in 10 ms
+ * units) and the programming since the last call (in 0.5 us ticks). The
+ * firmware restarts the programming counters.
+ */
+static int getTiming(Cf840Device* dev, uint32_t* eraseTime, uint32_t* progTime, uint32_t* progBytes)
+{
+    uint8_t* b = dev->resBuf;
+    int ret;
+
+    if (dev->timing == NULL || dev->timingOff || !hasCap(dev, CF840_CAP_TIMING)) {
+        return CF840_ERROR_PARAM;
+    }
+    // older firmware returns the serial number
+    ret = recvControlTransfer(dev, COMMAND_GET_TIME, 0, 0, b, 8);
+    if (ret != 8) {
+        logMsg(dev->ctx, "durations not supported by the firmware. result=%i\n", ret);
+        dev->timingOff = 1;
+        return CF840_ERROR_USB;
+    }
+    *eraseTime = b[0] | (b[1] << 8);
+    *progTime = b[2] | (b[3] << 8) | ((uint32_t) b[4] << 16) | ((uint32_t) b[5] << 24);
+    *progBytes = b[6] | (b[7] << 8);
+    return CF840_OK;
+}
+
+// reports the duration of the erase of 'len' bytes at 'addr'
+static void reportErase(Cf840Device* dev, uint32_t addr, uint32_t len)
+{
+    uint32_t eraseTime, progTime, progBytes;
+
+    if (getTiming(dev, &eraseTime, &progTime, &progBytes) == CF840_OK) {
+        dev->timing(dev->timingUser, CF840_OP_ERASE, addr, len, eraseTime * 10000);
+    }
+}
+
+/**
+ * Reports the programming time of the sector written so far when the write
+ * moves to the sector of 'pos' (MAX_CHIP_SIZE: the write ends). Without the
+ * sector layout the time is reported per 64 kbytes.
+ */
+static void reportWrite(Cf840Device* dev, uint32_t pos)
+{
+    uint32_t start = pos & ~0xFFFF;
+    uint32_t size;
+    uint32_t eraseTime, progTime, progBytes;
+
+    if (dev->timing == NULL || dev->timingOff || !hasCap(dev, CF840_CAP_TIMING)) {
+        return;
+    }
+    if (pos < MAX_CHIP_SIZE && dev->chip) {
+        cf840GetSector(dev->chip, pos, &start, &size);
+    }
+    if (start == dev->timingSector) {
+        return;
+    }
+    if (dev->timingSector < MAX_CHIP_SIZE &&
+        getTiming(dev, &eraseTime, &progTime, &progBytes) == CF840_OK && progBytes
+    ) {
+        dev->timing(dev->timingUser, CF840_OP_WRITE, dev->timingSector, progBytes, progTime / 2);
+    }
+    dev->timingSector = start;
+}
+
+int cf840EraseChip(Cf840Device* dev)
+{
+    int ret = sendSetup(dev, SETUP_ERASE, 0);
+    if (ret) {
+        return ret;
+    }
+    //wait for erase finished (takes ~ 5 secs for the full erase)
+    ret = waitForFlashIoFinish(dev, 1000 * 1000, 500 * 1000, STATUS_ERASE_FAIL);
+    if (ret) {
+        return ret < 0 ? ret : CF840_ERROR_ERASE;
+    }
+    reportErase(dev, 0, dev->chip ? dev->chip->size : MAX_CHIP_SIZE);
+    return CF840_OK;
+}
+
+int cf840EraseSector(Cf840Device* dev, uint32_t addr)
+{
+    int ret = sendSetup(dev, SETUP_SECTOR_ERASE, addr);
+    if (ret) {
+        return ret;
+    }
+    ret = waitForFlashIoFinish(dev, 100 * 1000, 50 * 1000, STATUS_ERASE_FAIL);
+    if (ret) {
+        return ret < 0 ? ret : CF840_ERROR_ERASE;
+    }
+    if (dev->timing) {
+        uint32_t start = addr;
+        uint32_t size = 0;
+        if (dev->chip) {
+            cf840GetSector(dev->chip, addr, &start, &size);
+        }
+        reportErase(dev, start, size);
+    }
+    return CF840_OK;
+}
+
+int cf840SectorProtect(Cf840Device* dev, uint32_t addr, uint8_t* status)
+{
+    int ret = sendSetup(dev, SETUP_VERIFY_PROTECT, addr);
+    if (ret) {
+        return ret;
+    }
+    usleep(100 * 1000);
+    ret = getData(dev);
+    *status = dev->resBuf[0];
+    return ret;
+}
+
+/**
+ * Reads 'len' bytes (up to 64) starting at the chip address 'pos'.
+ * The chip must be set up for reading (SETUP_READ).
+ */
+static int readBlock(Cf840Device* dev, uint32_t pos, uint8_t* dst, uint16_t len)
+{
+    uint16_t addr = pos & 0xFFFF; //16 bit base address
+    uint16_t bank = (pos >> 16) & 0xFF; //4 bit top address
+
+    // initiates reading of 'len' bytes
+    int ret = sendControlTransfer(dev, COMMAND_READ, addr, bank | (len << 8), NULL, 0);
+    if (ret != 0) {
+        logMsg(dev->ctx, "read set addr failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+
+    //wait until the buffer is filled
+    waitForFlashIoFinish(dev, 50, 20, 0);
+
+    // transfers the buffer with data directly to the destination
+    ret = recvControlTransfer(dev, COMMAND_READ | 1, addr, bank, dst, len);
+    if (ret != len) {
+        logMsg(dev->ctx, "get data failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+    return CF840_OK;
+}
+
+/**
+ * Reads up to 'blocks' blocks of 64 bytes starting at the chip address 'pos'.
+ * The firmware returns either a block with mixed data or the number of
+ * following blocks filled with one value. The data are expanded to 'dst'.
+ * Returns the number of bytes read or an error.
+ */
+static int readBlockRle(Cf840Device* dev, uint32_t pos, uint8_t* dst, uint8_t blocks)
+{
+    uint16_t addr = pos & 0xFFFF; //16 bit base address
+    uint16_t bank = (pos >> 16) & 0xFF; //4 bit top address
+
+    int ret = sendControlTransfer(dev, COMMAND_READ | 2, addr, bank | (blocks << 8), NULL, 0);
+    if (ret != 0) {
+        logMsg(dev->ctx, "read set addr failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+    waitForFlashIoFinish(dev, 50, 20, 0);
+
+    ret = recvControlTransfer(dev, COMMAND_READ | 1, addr, bank, dst, 64);
+    if (ret == 64) {
+        return 64;
+    }
+    if (ret == 2 && dst[0] > 0 && dst[0] <= blocks) {
+        int size = dst[0] * 64;
+        memset(dst, dst[1], size);
+        return size;
+    }
+    logMsg(dev->ctx, "get compressed data failed. result=%i\n", ret);
+    return CF840_ERROR_USB;
+}
+
+/**
+ * Reads or verifies a range of the chip.
+ * The data are compared with 'data' when it is set.
+ */
+static int readRange(Cf840Device* dev, uint32_t addr, uint8_t* buf, const uint8_t* data, uint32_t len, uint32_t* badAddr)
+{
+    uint8_t block[RLE_READ_BLOCKS * 64];
+    uint32_t pos = 0;
+    int result;
+    int i;
+
+    if (addr + len > MAX_CHIP_SIZE || len > MAX_CHIP_SIZE) {
+        return CF840_ERROR_PARAM;
+    }
+    result = sendSetup(dev, SETUP_READ, 0);
+    usleep(50);
+
+    while (result == CF840_OK && pos < len) {
+        // the firmware handles unaligned addresses: the last block may be shorter
+        uint32_t size = (len - pos < 64) ? len - pos : 64;
+        uint8_t* dst = data ? block : buf + pos;
+
+        if ((dev->features & CF840_FEATURE_RLE_READ) && len - pos >= 128) {
+            uint32_t blocks = (len - pos) / 64;
+            int ret = readBlockRle(dev, addr + pos, dst, blocks < RLE_READ_BLOCKS ? blocks : RLE_READ_BLOCKS);
+            if (ret < 0) {
+                result = ret;
+                break;
+            }
+            size = ret;
+        } else {
+            result = readBlock(dev, addr + pos, dst, size);
+        }
+        if (result == CF840_OK && data) {
+            for (i = 0; i < size; i++) {
+                if (dst[i] != data[pos + i]) {
+                    if (badAddr) {
+                        *badAddr = addr + pos + i;
+                    }
+                    result = CF840_ERROR_VERIFY;
+                    break;
+                }
+            }
+        }
+        pos += size;
+        progress(dev, data ? CF840_OP_VERIFY : CF840_OP_READ, addr + pos, pos, len);
+    }
+
+    // setup for Ready - set OE high
+    sendSetup(dev, SETUP_READY, 0);
+    usleep(50);
+    return result;
+}
+
+int cf840Read(Cf840Device* dev, uint32_t addr, uint8_t* buf, uint32_t len)
+{
+    return readRange(dev, addr, buf, NULL, len, NULL);
+}
+
+int cf840Verify(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, uint32_t* badAddr)
+{
+    return readRange(dev, addr, NULL, data, len, badAddr);
+}
+
+// state of cf840Diff(): the differing range being collected
+typedef struct {
+    Cf840DiffFn fn;
+    void* user;
+    uint32_t start;
+    uint32_t len;
+    uint32_t total;
+} DiffState;
+
+// two 16 bit sums of the firmware checksum: A = sum of the bytes, B = sum of A
+static uint32_t blockSum(const uint8_t* data, uint32_t len)
+{
+    uint16_t a = 0;
+    uint16_t b = 0;
+
+    while (len--) {
+        a += *data++;
+        b += a;
+    }
+    return a | ((uint32_t) b << 16);
+}
+
+// CRC-16 of the firmware (polynomial 0x1021, initial value 0xFFFF)
+static uint32_t blockCrc(const uint8_t* data, uint32_t len)
+{
+    uint16_t crc = 0xFFFF;
+    int i;
+
+    while (len--) {
+        crc ^= *data++ << 8;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// checksum of the data computed the same way as by the firmware of the device
+static uint32_t dataSum(Cf840Device* dev, const uint8_t* data, uint32_t len)
+{
+    return hasCap(dev, CF840_CAP_CRC) ? blockCrc(data, len) : blockSum(data, len);
+}
+
+// checksum of the second half of a range from the sums of the range and its first half
+static uint32_t secondHalfSum(uint32_t whole, uint32_t first, uint32_t halfLen)
+{
+    uint16_t a = (whole & 0xFFFF) - (first & 0xFFFF);
+    uint16_t b = (whole >> 16) - (first >> 16) - (uint16_t) (halfLen * (first & 0xFFFF));
+    return a | ((uint32_t) b << 16);
+}
+
+// reads the checksum of 2^shift bytes at 'pos' (aligned) from the firmware:
+// the CRC when supported, the sums otherwise
+static int readChecksum(Cf840Device* dev, uint32_t pos, int shift, uint32_t* sum)
+{
+    uint16_t addr = pos & 0xFFFF;
+    uint16_t bank = (pos >> 16) & 0xFF;
+    uint8_t* b = dev->resBuf;
+    int crc = hasCap(dev, CF840_CAP_CRC);
+    int len = crc ? 2 : 4;
+    int ret;
+
+    ret = sendControlTransfer(dev, COMMAND_READ | (crc ? 4 : 3), addr, bank | (shift << 8), NULL, 0);
+    if (ret != 0) {
+        logMsg(dev->ctx, "checksum request failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+    // the firmware reads a byte in ~2-3 us, the CRC takes longer
+    ret = waitForFlashIoFinish(dev, (1 << shift) * (crc ? 4 : 2), 1000, 0);
+    if (ret) {
+        return ret;
+    }
+    ret = recvControlTransfer(dev, COMMAND_READ | 1, addr, bank, b, len);
+    if (ret != len) {
+        logMsg(dev->ctx, "get checksum failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+    *sum = b[0] | (b[1] << 8);
+    if (!crc) {
+        *sum |= ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+    }
+    return CF840_OK;
+}
+
+// adds differing bytes at 'addr' to the collected range, reports the previous one
+static void diffAdd(DiffState* st, uint32_t addr, uint32_t len)
+{
+    if (st->len && st->start + st->len == addr) {
+        st->len += len;
+    } else {
+        if (st->len && st->fn) {
+            st->fn(st->user, st->start, st->len);
+        }
+        st->start = addr;
+        st->len = len;
+    }
+    st->total += len;
+}
+
+// reads up to 64 bytes and adds the ones differing from the data
+static int diffBytes(Cf840Device* dev, DiffState* st, uint32_t pos, const uint8_t* data, uint32_t len)
+{
+    uint8_t block[64];
+    uint32_t i;
+    int ret = readBlock(dev, pos, block, len);
+
+    for (i = 0; ret == CF840_OK && i < len; i++) {
+        if (block[i] != data[i]) {
+            diffAdd(st, pos + i, 1);
+        }
+    }
+    return ret;
+}
+
+/**
+ * Compares the aligned range of 2^shift bytes whose chip checksum is 'chipSum'.
+ * With the sums only the checksum of the first half is read from the chip,
+ * the second one is derived from it. When the checksums of the range differ
+ * but no differing byte is found in its halves (their checksums matched by
+ * chance), the whole range is read back and compared.
+ */
+static int diffBlock(Cf840Device* dev, DiffState* st, uint32_t pos, const uint8_t* data, int shift, uint32_t chipSum)
+{
+    uint32_t half = 1 << (shift - 1);
+    uint32_t total = st->total;
+    uint32_t first, second;
+    uint32_t i;
+    int ret;
+
+    if (chipSum == dataSum(dev, data, 1 << shift)) {
+        return CF840_OK;
+    }
+    if (shift == 6) {
+        return diffBytes(dev, st, pos, data, 64);
+    }
+    ret = readChecksum(dev, pos, shift - 1, &first);
+    if (ret == CF840_OK) {
+        if (hasCap(dev, CF840_CAP_CRC)) {
+            ret = readChecksum(dev, pos + half, shift - 1, &second);
+        } else {
+            second = secondHalfSum(chipSum, first, half);
+        }
+    }
+    if (ret == CF840_OK) {
+        ret = diffBlock(dev, st, pos, data, shift - 1, first);
+    }
+    if (ret == CF840_OK) {
+        ret = diffBlock(dev, st, pos + half, data + half, shift - 1, second);
+    }
+    // every block is compared: a collision may hide more than one of them
+    if (ret == CF840_OK && st->total == total) {
+        for (i = 0; ret == CF840_OK && i < (2 * half); i += 64) {
+            ret = diffBytes(dev, st, pos + i, data + i, 64);
+        }
+    }
+    return ret;
+}
+
+int cf840Diff(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, Cf840DiffFn fn, void* user)
+{
+    DiffState st;
+    uint32_t pos = addr;
+    uint32_t end = addr + len;
+    uint32_t sum;
+    int result;
+
+    if (end > MAX_CHIP_SIZE || len > MAX_CHIP_SIZE) {
+        return CF840_ERROR_PARAM;
+    }
+    if (!hasCap(dev, CF840_CAP_CHECKSUM)) {
+        return CF840_ERROR_UNSUPPORTED;
+    }
+    memset(&st, 0, sizeof(st));
+    st.fn = fn;
+    st.user = user;
+    result = sendSetup(dev, SETUP_READ, 0);
+    usleep(50);
+
+    while (result == CF840_OK && pos < end) {
+        int shift = 6;
+        uint32_t size;
+
+        if ((pos & 63) || end - pos < 64) {
+            // unaligned head and tail are compared directly
+            size = 64 - (pos & 63);
+            if (size > end - pos) {
+                size = end - pos;
+            }
+            result = diffBytes(dev, &st, pos, data + (pos - addr), size);
+        } else {
+            // the biggest aligned range fitting into the rest
+            while (shift < DIFF_TOP_SHIFT && (pos & ((2u << shift) - 1)) == 0 && end - pos >= (2u << shift)) {
+                shift++;
+            }
+            size = 1 << shift;
+            result = readChecksum(dev, pos, shift, &sum);
+            if (result == CF840_OK) {
+                result = diffBlock(dev, &st, pos, data + (pos - addr), shift, sum);
+            }
+        }
+        pos += size;
+        progress(dev, CF840_OP_VERIFY, pos, pos - addr, len);
+    }
+    // the last range
+    if (result == CF840_OK && st.len && fn) {
+        fn(user, st.start, st.len);
+    }
+
+    sendSetup(dev, SETUP_READY, 0);
+    usleep(50);
+    return result ? result : (int) st.total;
+}
+
+int cf840Checksum(Cf840Device* dev, uint32_t addr, uint32_t len, uint32_t* sum)
+{
+    uint8_t block[64];
+    uint32_t pos = addr;
+    uint32_t end = addr + len;
+    uint32_t part;
+    int result;
+
+    if (end > MAX_CHIP_SIZE || len > MAX_CHIP_SIZE) {
+        return CF840_ERROR_PARAM;
+    }
+    if (!hasCap(dev, CF840_CAP_CHECKSUM)) {
+        return CF840_ERROR_UNSUPPORTED;
+    }
+    *sum = 0;
+    result = sendSetup(dev, SETUP_READ, 0);
+    usleep(50);
+
+    // the same split of the range as in cf840Diff(), the sums of the parts are chained
+    while (result == CF840_OK && pos < end) {
+        int shift = 6;
+        uint32_t size;
+
+        if ((pos & 63) || end - pos < 64) {
+            size = 64 - (pos & 63);
+            if (size > end - pos) {
+                size = end - pos;
+            }
+            result = readBlock(dev, pos, block, size);
+            part = dataSum(dev, block, size);
+        } else {
+            while (shift < DIFF_TOP_SHIFT && (pos & ((2u << shift) - 1)) == 0 && end - pos >= (2u << shift)) {
+                shift++;
+            }
+            size = 1 << shift;
+            result = readChecksum(dev, pos, shift, &part);
+        }
+        *sum = ((*sum << 5) | (*sum >> 27)) ^ part;
+        pos += size;
+        progress(dev, CF840_OP_VERIFY, pos, pos - addr, len);
+    }
+
+    sendSetup(dev, SETUP_READY, 0);
+    usleep(50);
+    return result;
+}
+
+// erases the sector containing 'pos' if not erased by the current write yet
+static int eraseOnce(Cf840Device* dev, uint32_t pos)
+{
+    uint32_t start, len;
+    int sector = cf840GetSector(dev->chip, pos, &start, &len);
+    int ret;
+
+    if (dev->erased[sector >> 5] & (1 << (sector & 31))) {
+        return CF840_OK;
+    }
+    logMsg(dev->ctx, "erasing sector at 0x%06x (%i kbytes)\n", start, len / 1024);
+    ret = cf840EraseSector(dev, start);
+    if (ret) {
+        return ret;
+    }
+    dev->erased[sector >> 5] |= 1 << (sector & 31);
+    // erase resets the chip: setup for Write again -> set WE low
+    sendSetup(dev, SETUP_WRITE, 0);
+    usleep(500);
+    return CF840_OK;
+}
+
+int cf840MarkErased(Cf840Device* dev, uint32_t addr, uint32_t len)
+{
+    uint32_t start, size;
+    uint32_t pos = addr;
+    int sector;
+
+    if (len == 0) {
+        memset(dev->erased, 0, sizeof(dev->erased));
+        return CF840_OK;
+    }
+    if (addr + len > MAX_CHIP_SIZE || len > MAX_CHIP_SIZE) {
+        return CF840_ERROR_PARAM;
+    }
+    if (cf840GetChip(dev) == NULL) {
+        return CF840_ERROR_UNKNOWN_CHIP;
+    }
+    while (pos < addr + len) {
+        sector = cf840GetSector(dev->chip, pos, &start, &size);
+        dev->erased[sector >> 5] |= 1 << (sector & 31);
+        pos = start + size;
+    }
+    return CF840_OK;
+}
+
+// sends a write packet and waits until the firmware programs it
+static int writePacket(Cf840Device* dev, uint8_t command, uint32_t pos, const uint8_t* buf, int size, int flags)
+{
+    uint16_t addr = pos & 0xFFFF; //16 bit base address
+    uint16_t bank = (pos >> 16) & 0xFF; // 4 bit top address bank
+
+    // the last chunk may be shorter: only the valid bytes are sent
+    int ret = sendControlTransfer(dev, command, addr, bank | ((flags & CF840_WRITE_SLOW) ? 0x100 : 0), buf, size);
+    if (ret != size) {
+        logMsg(dev->ctx, "write packet failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+
+    ret = waitForFlashIoFinish(dev, 1000, 100, STATUS_ERASE);
+    if (ret) {
+        return ret < 0 ? ret : CF840_ERROR_WRITE;
+    }
+    return CF840_OK;
+}
+
+// length of the run of equal bytes at 'data' (up to 128 and 'len')
+static uint32_t runLength(const uint8_t* data, uint32_t len)
+{
+    uint32_t n = 1;
+    while (n < len && n < 128 && data[n] == data[0]) {
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Encodes the data into one RLE packet of up to 64 bytes. Tokens 0..0x7F
+ * are followed by 1..128 literal bytes, tokens 0x80..0xFF repeat the next
+ * byte 1..128 times. Returns the number of data bytes encoded.
+ */
+static uint32_t encodeRle(const uint8_t* data, uint32_t len, uint8_t* packet, int* size)
+{
+    uint32_t pos = 0;
+    int o = 0;
+
+    while (pos < len && o <= 62) {
+        uint32_t run = runLength(data + pos, len - pos);
+        // erased bytes are skipped by the firmware: even short runs of them pay off
+        if (run >= 3 || (run == 2 && data[pos] == 0xFF)) {
+            packet[o++] = 0x80 | (run - 1);
+            packet[o++] = data[pos];
+            pos += run;
+        } else {
+            uint32_t n = 0;
+            // literals up to the next run worth encoding
+            while (pos + n < len && n < 128 && o + 1 + n < 64) {
+                if (n > 0 && runLength(data + pos + n, len - pos - n) >= 3) {
+                    break;
+                }
+                n++;
+            }
+            packet[o++] = n - 1;
+            memcpy(packet + o, data + pos, n);
+            o += n;
+            pos += n;
+        }
+    }
+    *size = o;
+    return pos;
+}
+
+/**
+ * Writes the data from 'pos' up to 'end'. Returns the number of bytes
+ * written or an error. A chunk must not cross a 64 byte boundary, an RLE
+ * packet stays within a block of RLE_BLOCK bytes. With CF840_WRITE_ERASE
+ * the sector is erased when the first data of the sector are written.
+ */
+static int writeNext(Cf840Device* dev, uint32_t pos, const uint8_t* data, uint32_t end, int flags)
+{
+    uint8_t packet[64];
+    uint32_t size = 64 - (pos & 63);
+    uint32_t encoded = 0;
+    int packetSize = 0;
+    int ret;
+
+    if (size > end - pos) {
+        size = end - pos;
+    }
+    // the time of the previous sector is taken before the erase restarts the counters
+    reportWrite(dev, pos);
+    if (flags & CF840_WRITE_ERASE) {
+        ret = eraseOnce(dev, pos);
+        if (ret) {
+            return ret;
+        }
+    }
+    if ((flags & CF840_WRITE_RLE) && hasCap(dev, CF840_CAP_RLE_WRITE)) {
+        uint32_t len = RLE_BLOCK - (pos & (RLE_BLOCK - 1));
+        encoded = encodeRle(data, (len < end - pos) ? len : end - pos, packet, &packetSize);
+    }
+    // packets which do not pay off are sent as plain data
+    if (encoded > size) {
+        ret = writePacket(dev, COMMAND_WRITE_RLE, pos, packet, packetSize, flags);
+        size = encoded;
+    } else {
+        ret = writePacket(dev, COMMAND_WRITE, pos, data, size, flags);
+    }
+    return ret ? ret : (int) size;
+}
+
+int cf840Write(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, int flags)
+{
+    uint32_t pos = addr;
+    uint32_t end = addr + len;
+    int result;
+
+    if (end > MAX_CHIP_SIZE || len > MAX_CHIP_SIZE) {
+        return CF840_ERROR_PARAM;
+    }
+    if ((flags & CF840_WRITE_ERASE) && cf840GetChip(dev) == NULL) {
+        return CF840_ERROR_UNKNOWN_CHIP;
+    }
+    if (!(flags & CF840_WRITE_APPEND)) {
+        memset(dev->erased, 0, sizeof(dev->erased));
+    }
+
+    // setup for Write -> set WE low
+    result = sendSetup(dev, SETUP_WRITE, 0);
+    usleep(500);
+    dev->timingSector = MAX_CHIP_SIZE;
+
+    while (result == CF840_OK && pos < end) {
+        int size = writeNext(dev, pos, data + (pos - addr), end, flags);
+        if (size < 0) {
+            result = size;
+            break;
+        }
+        pos += size;
+        progress(dev, CF840_OP_WRITE, pos, pos - addr, len);
+    }
+    reportWrite(dev, MAX_CHIP_SIZE);
+
+    // setup for Ready - set WE high
+    sendSetup(dev, SETUP_READY, 0);
+    return result;
+}
+
+static void* asyncWorker(void* arg)
+{
+    Cf840Device* dev = (Cf840Device*) arg;
+    int result = CF840_ERROR_PARAM;
+
+    switch (dev->asyncType) {
+        case ASYNC_READ:
+            result = cf840Read(dev, dev->asyncAddr, dev->asyncBuf, dev->asyncLen);
+            break;
+        case ASYNC_WRITE:
+            result = cf840Write(dev, dev->asyncAddr, dev->asyncData, dev->asyncLen, dev->asyncFlags);
+            break;
+        case ASYNC_VERIFY:
+            result = cf840Verify(dev, dev->asyncAddr, dev->asyncData, dev->asyncLen, dev->asyncBadAddr);
+            break;
+        case ASYNC_ERASE:
+            result = cf840EraseChip(dev);
+            break;
+    }
+    dev->asyncResult = result;
+    if (dev->asyncDone) {
+        dev->asyncDone(dev->asyncUser, dev, result);
+    }
+    return NULL;
+}
+
+static int startAsync(Cf840Device* dev, int type, Cf840DoneFn done, void* user)
+{
+    dev->asyncType = type;
+    dev->asyncDone = done;
+    dev->asyncUser = user;
+    if (pthread_create(&dev->worker, NULL, asyncWorker, dev)) {
+        return CF840_ERROR_NO_MEMORY;
+    }
+    dev->asyncStarted = 1;
+    return CF840_OK;
+}
+
+int cf840ReadAsync(Cf840Device* dev, uint32_t addr, uint8_t* buf, uint32_t len, Cf840DoneFn done, void* user)
+{
+    if (dev->asyncStarted) {
+        return CF840_ERROR_BUSY;
+    }
+    dev->asyncAddr = addr;
+    dev->asyncBuf = buf;
+    dev->asyncLen = len;
+    return startAsync(dev, ASYNC_READ, done, user);
+}
+
+int cf840WriteAsync(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, int flags, Cf840DoneFn done, void* user)
+{
+    if (dev->asyncStarted) {
+        return CF840_ERROR_BUSY;
+    }
+    dev->asyncAddr = addr;
+    dev->asyncData = data;
+    dev->asyncLen = len;
+    dev->asyncFlags = flags;
+    return startAsync(dev, ASYNC_WRITE, done, user);
+}
+
+int cf840VerifyAsync(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, uint32_t* badAddr, Cf840DoneFn done, void* user)
+{
+    if (dev->asyncStarted) {
+        return CF840_ERROR_BUSY;
+    }
+    dev->asyncAddr = addr;
+    dev->asyncData = data;
+    dev->asyncLen = len;
+    dev->asyncBadAddr = badAddr;
+    return startAsync(dev, ASYNC_VERIFY, done, user);
+}
+
+int cf840EraseChipAsync(Cf840Device* dev, Cf840DoneFn done, void* user)
+{
+    if (dev->asyncStarted) {
+        return CF840_ERROR_BUSY;
+    }
+    return startAsync(dev, ASYNC_ERASE, done, user);
+}
+
+int cf840Wait(Cf840Device* dev)
+{
+    if (!dev->asyncStarted) {
+        return dev->asyncResult;
+    }
+    pthread_join(dev->worker, NULL);
+    dev->asyncStarted = 0;
+    return dev->asyncResult;
+}
+
+int cf840Script(Cf840Device* dev, const uint8_t* script, int len, uint8_t* out, int max)
+{
+    int cnt;
+    int ret;
+
+    if (len < 1 || len > CF840_SCRIPT_MAX) {
+        return CF840_ERROR_PARAM;
+    }
+    if (!hasCap(dev, CF840_CAP_SCRIPT)) {
+        return CF840_ERROR_UNSUPPORTED;
+    }
+    ret = sendControlTransfer(dev, COMMAND_SCRIPT, 0, 0, script, len);
+    if (ret != len) {
+        logMsg(dev->ctx, "script upload failed. result=%i\n", ret);
+        return CF840_ERROR_USB;
+    }
+    ret = waitForFlashIoFinish(dev, 100, 100, STATUS_SCRIPT_FAIL);
+    if (ret) {
+        return ret < 0 ? ret : CF840_ERROR_SCRIPT;
+    }
+    // the firmware reports the number of bytes read in the data byte
+    cnt = dev->resBuf[0];
+    if (cnt > max) {
+        cnt = max;
+    }
+    if (cnt > 0) {
+        ret = recvControlTransfer(dev, COMMAND_READ | 1, 0, 0, out, cnt);
+        if (ret != cnt) {
+            logMsg(dev->ctx, "get script data failed. result=%i\n", ret);
+            return CF840_ERROR_USB;
+        }
+    }
+    return cnt;
+}
+
+int cf840Command(Cf840Device* dev, uint8_t command, uint16_t value, uint16_t index)
+{
+    int ret = sendControlTransfer(dev, command, value, index, NULL, 0);
+    return ret < 0 ? CF840_ERROR_USB : CF840_OK;
+}
+
+int cf840Request(Cf840Device* dev, uint8_t command, uint16_t value, uint16_t index, uint8_t* buf, uint16_t len)
+{
+    int ret = recvControlTransfer(dev, command, value, index, buf, len);
+    return ret < 0 ? CF840_ERROR_USB : ret;
+}
+
+const char* cf840ErrorName(int result)
+{
+    static const char* const names[] = {
+        "OK", "USB transfer failed", "programmer not found", "can't access the programmer",
+        "invalid parameter", "operation in progress", "erase failed", "write failed",
+        "verify failed", "unknown chip", "out of memory", "script failed",
+        "not supported by the firmware"
+    };
+    if (result > 0) {
+        return names[0];
+    }
+    if (-result < (int) (sizeof(names) / sizeof(names[0]))) {
+        return names[-result];
+    }
+    return "unknown error";
+}
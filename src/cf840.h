@@ -0,0 +1,316 @@
+/* cf840 - library for the CH55x based 27CF840 programmer
+ *
+ * Copyright (C) 2020 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The library drives the programmer boards: it finds them on the USB bus
+ * and reads, writes, verifies and erases the flash chips in memory.
+ * It does not print anything and does not exit: all functions return
+ * CF840_OK (or a positive value) on success and a negative CF840_ERROR_*
+ * code on failure.
+ *
+ * Each device has its own buffers and state: different devices can be used
+ * from different threads at the same time. One device must be used from
+ * one thread at a time. The *Async functions run the operation on a worker
+ * thread and call the 'done' callback from that thread when finished.
+ *
+ * Build prog_pc together with cf840.c, or link cf840.c into your
+ * application with -lusb-1.0 -lpthread.
+ */
+
+#ifndef CF840_H
+#define CF840_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// result codes
+#define CF840_OK                  0
+#define CF840_ERROR_USB          -1  // USB transfer failed
+#define CF840_ERROR_NOT_FOUND    -2  // no programmer matches
+#define CF840_ERROR_ACCESS       -3  // the programmer can't be opened or claimed
+#define CF840_ERROR_PARAM        -4  // invalid parameter
+#define CF840_ERROR_BUSY         -5  // an asynchronous operation is running
+#define CF840_ERROR_ERASE        -6  // the chip reported an erase failure
+#define CF840_ERROR_WRITE        -7  // the chip reported a program failure
+#define CF840_ERROR_VERIFY       -8  // the data read back differ
+#define CF840_ERROR_UNKNOWN_CHIP -9  // sector layout is needed, but the chip is unknown
+#define CF840_ERROR_NO_MEMORY    -10
+#define CF840_ERROR_SCRIPT       -11 // the script is invalid or its wait timed out
+#define CF840_ERROR_UNSUPPORTED  -12 // the firmware does not support the operation
+
+// operations reported to the progress callback
+#define CF840_OP_READ   1
+#define CF840_OP_WRITE  2
+#define CF840_OP_VERIFY 3
+#define CF840_OP_ERASE  4  // reported to the timing callback only
+
+// flags of cf840Write()
+#define CF840_WRITE_SLOW   1  // ignore the READY signal of the chip
+#define CF840_WRITE_ERASE  2  // erase the sectors touched by the data before writing them
+#define CF840_WRITE_APPEND 4  // continues the previous write: sectors erased by it are not erased again
+#define CF840_WRITE_RLE    8  // send run-length encoded packets (ignored when the firmware reports no support)
+
+// optional firmware features, see cf840SetFeatures()
+#define CF840_FEATURE_RLE_READ 1  // blank and padded areas are read as runs of blocks
+
+// features of the firmware, see cf840GetCapabilities()
+#define CF840_CAP_RLE_WRITE  0x0001  // run-length encoded write packets (CF840_WRITE_RLE)
+#define CF840_CAP_RLE_READ   0x0002  // compressed reads (CF840_FEATURE_RLE_READ)
+#define CF840_CAP_RANGE_READ 0x0004  // reads of 1..64 bytes per request
+#define CF840_CAP_CHECKSUM   0x0008  // checksums of chip ranges (cf840Diff)
+#define CF840_CAP_SCRIPT     0x0010  // bus scripts (cf840Script)
+#define CF840_CAP_TIMING     0x0020  // erase and program durations (cf840SetTiming)
+#define CF840_CAP_POLLING    0x0040  // DQ7 data polling for the chips without READY
+#define CF840_CAP_CHIP_ALG   0x0080  // command set selected by the chip ID
+#define CF840_CAP_BULK       0x0100  // bulk endpoints
+#define CF840_CAP_ID_MAP     0x0200  // IDs and protection map in one request (cf840ProtectMap)
+#define CF840_CAP_SELF_TEST  0x0400  // board and module self-test (cf840SelfTest)
+#define CF840_CAP_CRC        0x0800  // CRC-16 instead of the sums for the checksums of chip ranges
+
+// size of the sector protection map: one bit per 8 kbytes
+#define CF840_PROTECT_MAP_SIZE 16
+
+// location of the small boot sectors
+#define CF840_BOOT_TOP    0
+#define CF840_BOOT_BOTTOM 1
+
+// vendor commands of the firmware, for cf840Command() and cf840Request()
+#define CF840_CMD_SET_SHREG  0x10
+#define CF840_CMD_SET_ADDR   0x20
+#define CF840_CMD_SET_DATA   0x30
+#define CF840_CMD_GET_DATA   0x40
+#define CF840_CMD_BOOTLOADER 0xB0
+
+// opcodes of the bus scripts run by cf840Script(), followed by their operands
+#define CF840_SCRIPT_END      0x00  // end of the script
+#define CF840_SCRIPT_ADDR     0x01  // bank, high, low: set the 20 bit address
+#define CF840_SCRIPT_WRITE    0x02  // data: write a byte to the current address
+#define CF840_SCRIPT_WRITE16  0x03  // high, low, data: write a byte to the address in bank 0
+#define CF840_SCRIPT_READ     0x04  // read a byte from the current address and return it
+#define CF840_SCRIPT_INC      0x05  // increment the address
+#define CF840_SCRIPT_WAIT_RDY 0x06  // ms: wait until the READY signal is high
+#define CF840_SCRIPT_POLL     0x07  // data, ms: wait until DQ7 of the read byte equals bit 7 of data
+#define CF840_SCRIPT_LOOP     0x08  // count: repeat the ops up to CF840_SCRIPT_NEXT (0 = 256 times)
+#define CF840_SCRIPT_NEXT     0x09  // end of the loop body
+#define CF840_SCRIPT_DELAY    0x0A  // us: wait
+
+// maximum size of a script and of the data it returns
+#define CF840_SCRIPT_MAX 64
+
+typedef struct Cf840Context Cf840Context;
+typedef struct Cf840Device Cf840Device;
+
+// Flash chip description identified by its device ID (byte mode)
+typedef struct {
+    uint8_t deviceId;
+    const char* name;
+    uint32_t size;
+    uint8_t boot;
+} Cf840ChipInfo;
+
+// 'addr' is the chip address being processed, 'done' and 'total' count
+// the bytes of the current call
+typedef void (*Cf840ProgressFn)(void* user, int op, uint32_t addr, uint32_t done, uint32_t total);
+
+// called from the worker thread when an asynchronous operation finishes
+typedef void (*Cf840DoneFn)(void* user, Cf840Device* dev, int result);
+
+// Firmware of the programmer, queried when the device is opened. Older
+// firmware does not report it: 'protocol' is 0 and the other fields are 0,
+// only the operations not listed in CF840_CAP_* are used with it.
+typedef struct {
+    int protocol;   // version of the USB protocol
+    int version;    // firmware version: major << 8 | minor
+    int blockSize;  // maximum payload of a read or write request
+    int buffers;    // number of payload buffers
+    int caps;       // CF840_CAP_*
+} Cf840Capabilities;
+
+// called by cf840Diff() for each range of the chip differing from the data
+typedef void (*Cf840DiffFn)(void* user, uint32_t addr, uint32_t len);
+
+// Durations measured by the firmware: CF840_OP_ERASE reports an erase of
+// 'len' bytes at 'addr' (the whole chip for a chip erase), CF840_OP_WRITE the
+// time spent programming 'len' bytes of the sector at 'addr' (erased bytes
+// skipped by RLE packets are not counted).
+typedef void (*Cf840TimingFn)(void* user, int op, uint32_t addr, uint32_t len, uint32_t us);
+
+// diagnostic messages (verbose mode of prog_pc)
+typedef void (*Cf840LogFn)(void* user, const char* msg);
+
+struct libusb_context;
+struct libusb_device;
+
+int cf840Init(Cf840Context** ctx);
+void cf840Exit(Cf840Context* ctx);
+void cf840SetLog(Cf840Context* ctx, Cf840LogFn fn, void* user);
+struct libusb_context* cf840UsbContext(Cf840Context* ctx);
+
+// Opens the programmers. 'paths' is a newline separated list of USB port
+// paths (like 1-2.4) to look at, NULL checks all devices.
+// Returns the number of programmers opened into 'list'.
+int cf840OpenAll(Cf840Context* ctx, const char* paths, Cf840Device** list, int max);
+
+// Opens the programmer selected by its port path or serial number
+// (NULL or "" selects the first one found).
+int cf840Open(Cf840Context* ctx, const char* id, Cf840Device** dev);
+
+// Opens the USB device if it is a programmer (hotplug)
+int cf840OpenUsb(Cf840Context* ctx, struct libusb_device* usbDev, Cf840Device** dev);
+
+// Closes the device, waits for the asynchronous operation first
+void cf840Close(Cf840Device* dev);
+
+const char* cf840Path(Cf840Device* dev);
+const char* cf840Serial(Cf840Device* dev);
+struct libusb_device* cf840UsbDevice(Cf840Device* dev);
+void cf840SetProgress(Cf840Device* dev, Cf840ProgressFn fn, void* user);
+
+// Sets the callback receiving the durations of the erase and program
+// operations (NULL disables it). Needs the firmware measuring them: the
+// callback is not called with older firmware.
+void cf840SetTiming(Cf840Device* dev, Cf840TimingFn fn, void* user);
+
+// Sets the timeout of the USB transfers in ms (0 restores the default of
+// 50 ms). Transfers failing on a timeout or I/O error are repeated up to
+// 3 times, the USB device is reset before the last attempt.
+void cf840SetTimeout(Cf840Device* dev, int ms);
+
+// Enables the CF840_FEATURE_* of the firmware used by the read and verify
+// operations. Older firmware does not support them: all are off by default.
+// The features missing in the reported capabilities are ignored.
+void cf840SetFeatures(Cf840Device* dev, int features);
+
+// Capabilities reported by the firmware
+const Cf840Capabilities* cf840GetCapabilities(Cf840Device* dev);
+
+// Reads the manufacturer and device ID of the chip (and remembers the chip).
+// Uses one request when the firmware supports cf840ProtectMap().
+int cf840Identify(Cf840Device* dev, uint8_t* manufId, uint8_t* deviceId);
+
+// Reads the IDs and the protection of all sectors in one request (and
+// remembers the chip): bit (i & 7) of protect[i >> 3] is set when the
+// 8 kbytes at i * 8192 are protected. 'protect' holds CF840_PROTECT_MAP_SIZE
+// bytes. Needs the firmware reporting CF840_CAP_ID_MAP.
+int cf840ProtectMap(Cf840Device* dev, uint8_t* manufId, uint8_t* deviceId, uint8_t* protect);
+
+// faults found by cf840SelfTest(), see Cf840SelfTestResult
+#define CF840_TEST_NO_AUTOSELECT 0x01  // the ID reads return the array: WE#, CE# or the unlock cycles fail
+#define CF840_TEST_RDY_LOW       0x02  // READY is low while the chip is idle
+#define CF840_TEST_ADDR_SKIPPED  0x04  // the address lines were not tested (non AMD command set)
+
+// Result of the self-test. Data line i is bit i (DQi, P1.i), address line
+// i is bit i of the byte address (bit 0: A-1, bit i: A(i-1) of the chip).
+typedef struct {
+    int flags;              // CF840_TEST_*
+    uint8_t dataStuckLow;   // lines reading low when released
+    uint8_t dataStuckHigh;  // lines reading high when driven low
+    uint8_t dataShort;      // lines following another line
+    uint32_t addrSuspect;   // lines changing the ID reads wrongly
+    uint8_t manufId;        // IDs read in the autoselect mode
+    uint8_t deviceId;
+} Cf840SelfTestResult;
+
+// Runs the self-test of the programmer and the flash module in the firmware:
+// walking ones and zeros on the data bus, READY of the idle chip, the unlock
+// cycles and the address lines probed by the ID reads. Returns CF840_OK when
+// the test ran: the faults are in 'result'. Needs CF840_CAP_SELF_TEST.
+int cf840SelfTest(Cf840Device* dev, Cf840SelfTestResult* result);
+
+// The chip identified by the last cf840Identify(), identifies it if not done yet.
+// Returns NULL for unknown chips.
+const Cf840ChipInfo* cf840GetChip(Cf840Device* dev);
+const Cf840ChipInfo* cf840FindChip(uint8_t deviceId);
+
+// Finds the sector containing the address 'pos', returns the sector index
+int cf840GetSector(const Cf840ChipInfo* chip, uint32_t pos, uint32_t* start, uint32_t* size);
+
+int cf840Read(Cf840Device* dev, uint32_t addr, uint8_t* buf, uint32_t len);
+int cf840Write(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, int flags);
+
+// Marks the sectors touched by the range as erased by the current write:
+// the following cf840Write() calls with CF840_WRITE_APPEND do not erase them
+// again. Used to resume an interrupted write. 'len' 0 forgets all sectors.
+int cf840MarkErased(Cf840Device* dev, uint32_t addr, uint32_t len);
+
+// Compares the chip contents with the data. On CF840_ERROR_VERIFY 'badAddr'
+// (if not NULL) is set to the first address that differs.
+int cf840Verify(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, uint32_t* badAddr);
+
+// Finds the bytes of the chip differing from the data. The firmware sums
+// large ranges of the chip, only the ranges whose checksums differ are
+// split further and only the differing 64 byte blocks are read. 'fn' gets
+// the differing ranges in ascending order. Returns the number of differing
+// bytes or an error. Needs the firmware supporting the checksums.
+// The result is probabilistic: differences giving the same checksum of a
+// range are not found. The firmware without CF840_CAP_CRC sums the bytes, so
+// e.g. +1 in one byte and -1 in another one cancel out; the CRC-16 misses
+// about one of 65536 random changes. cf840Verify() compares all bytes.
+int cf840Diff(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, Cf840DiffFn fn, void* user);
+
+// Computes a checksum of a range of the chip. The firmware sums the aligned
+// blocks, only the unaligned head and tail are read. Chips with the same
+// contents of the range give the same checksum. Needs the firmware
+// supporting the checksums. The checksums of two devices are comparable only
+// when both or none of them report CF840_CAP_CRC.
+int cf840Checksum(Cf840Device* dev, uint32_t addr, uint32_t len, uint32_t* sum);
+
+int cf840EraseChip(Cf840Device* dev);
+int cf840EraseSector(Cf840Device* dev, uint32_t addr);
+
+// Reads the sector protection status byte of the sector at 'addr'
+int cf840SectorProtect(Cf840Device* dev, uint32_t addr, uint8_t* status);
+
+// Asynchronous variants: return CF840_OK when started. The result is passed
+// to 'done' (may be NULL) and returned by cf840Wait(). Only one operation
+// per device may be started: call cf840Wait() before starting the next one.
+// The buffers must stay valid until the operation finishes.
+int cf840ReadAsync(Cf840Device* dev, uint32_t addr, uint8_t* buf, uint32_t len, Cf840DoneFn done, void* user);
+int cf840WriteAsync(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, int flags, Cf840DoneFn done, void* user);
+int cf840VerifyAsync(Cf840Device* dev, uint32_t addr, const uint8_t* data, uint32_t len, uint32_t* badAddr, Cf840DoneFn done, void* user);
+int cf840EraseChipAsync(Cf840Device* dev, Cf840DoneFn done, void* user);
+
+// Waits for the asynchronous operation and returns its result
+int cf840Wait(Cf840Device* dev);
+
+// Runs a bus script (CF840_SCRIPT_* opcodes, up to CF840_SCRIPT_MAX bytes)
+// on the programmer in one transfer. The bytes read by the script are stored
+// to 'out' (up to 'max'). Returns the number of bytes read or an error.
+// Needs the firmware supporting the scripts.
+int cf840Script(Cf840Device* dev, const uint8_t* script, int len, uint8_t* out, int max);
+
+// Raw vendor commands for testing the board. cf840Request() returns
+// the number of bytes received.
+int cf840Command(Cf840Device* dev, uint8_t command, uint16_t value, uint16_t index);
+int cf840Request(Cf840Device* dev, uint8_t command, uint16_t value, uint16_t index, uint8_t* buf, uint16_t len);
+
+const char* cf840ErrorName(int result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -95,31 +95,145 @@ SBIT(FLCE, PORT3, PIN_FLCE);
 #define CMD_GET_DATA    0x40
 #define CMD_WRITE       0x50
 #define CMD_WRITE_SLOW  0x51
+#define CMD_WRITE_RLE   0x52
 #define CMD_READ        0x60
+#define CMD_READ_RLE    0x62
+#define CMD_READ_SUM    0x63
+#define CMD_READ_CRC    0x64
+#define CMD_SCRIPT      0x70
+#define CMD_GET_CAPS    0x80
 #define CMD_BOOTLOADER  0xB0
 #define CMD_SET_UP      0xF0
 
+// Reply to CMD_GET_CAPS. Older firmware stalls the request.
+#define PROTOCOL_VERSION  1
+#define FW_VERSION_MAJOR  0
+#define FW_VERSION_MINOR  4
+#define RW_BUFFERS        1
+
+// optional features reported by CMD_GET_CAPS
+#define CAP_RLE_WRITE   0x0001  // CMD_WRITE_RLE
+#define CAP_RLE_READ    0x0002  // CMD_READ_RLE
+#define CAP_RANGE_READ  0x0004  // CMD_READ of 1..64 bytes
+#define CAP_CHECKSUM    0x0008  // CMD_READ_SUM
+#define CAP_SCRIPT      0x0010  // CMD_SCRIPT
+#define CAP_TIMING      0x0020  // erase and program durations (CMD_GET_DATA 2)
+#define CAP_POLLING     0x0040  // DQ7 polling of the chips without READY
+#define CAP_CHIP_ALG    0x0080  // command set selected by the chip ID
+#define CAP_ID_MAP      0x0200  // IDs and protection of all sectors (SETUP_ID_MAP)
+#define CAP_SELF_TEST   0x0400  // board and module self-test (SETUP_SELF_TEST)
+#define CAP_CRC         0x0800  // CMD_READ_CRC
+#define CAPS (CAP_RLE_WRITE | CAP_RLE_READ | CAP_RANGE_READ | CAP_CHECKSUM | CAP_SCRIPT | CAP_TIMING | CAP_POLLING | CAP_CHIP_ALG | CAP_ID_MAP | CAP_SELF_TEST | CAP_CRC)
+
+// unique chip ID stored by the manufacturer in the code flash (4 bytes)
+#ifndef ROM_CHIP_ID_LO
+#define ROM_CHIP_ID_LO  0x3FFC
+#endif
+
 #define SETUP_MANUF_ID    0
 #define SETUP_DEVICE_ID   1
 #define SETUP_SECTOR_VERIFY  2
+#define SETUP_ID_MAP      3
 #define SETUP_ERASE       4
 #define SETUP_ERASE_SECTOR 5
 #define SETUP_READ        6
 #define SETUP_WRITE       7
+#define SETUP_SELF_TEST   8
 #define SETUP_READY      10
 
+// Result of the self-test in rwBuffer: byte offsets
+#define TEST_FLAGS      0  // TEST_* below
+#define TEST_DATA_LOW   1  // data lines reading low when released
+#define TEST_DATA_HIGH  2  // data lines reading high when driven low
+#define TEST_DATA_SHORT 3  // data lines following another line
+#define TEST_ADDR       4  // 3 bytes: suspect lines of the byte address (bit 0: A-1)
+#define TEST_MANUF_ID   7
+#define TEST_DEVICE_ID  8
+#define TEST_SIZE       9
+
+#define TEST_NO_AUTOSELECT 0x01  // the ID reads return the array: WE#, CE# or the unlock cycles fail
+#define TEST_RDY_LOW       0x02  // READY is low while the chip is idle
+#define TEST_ADDR_SKIPPED  0x04  // the command set of the chip does not allow the address test
+
 #define STATUS_INITIALISED    0x00
 #define STATUS_ERASE          0x01
 #define STATUS_ERASE_FAIL     0x02  
 #define STATUS_PROGRAM        0x03
 #define STATUS_PROGRAM_FAIL   0x04
-
+#define STATUS_SCRIPT_FAIL    0x05
+#define STATUS_SCRIPT         0x70
+
+// Opcodes of the bus scripts (CMD_SCRIPT), followed by their operand bytes
+#define OP_END       0x00  // end of the script
+#define OP_ADDR      0x01  // bank, high, low: set the 20 bit address
+#define OP_WRITE     0x02  // data: write a byte to the current address (CE and WE pulse)
+#define OP_WRITE16   0x03  // high, low, data: write a byte to the address in bank 0
+#define OP_READ      0x04  // read a byte from the current address and return it
+#define OP_INC       0x05  // increment the address
+#define OP_WAIT_RDY  0x06  // ms: wait until the READY signal is high
+#define OP_POLL      0x07  // data, ms: wait until DQ7 of the read byte equals bit 7 of data
+#define OP_LOOP      0x08  // count: repeat the ops up to OP_NEXT (0 = 256 times)
+#define OP_NEXT      0x09  // end of the loop body
+#define OP_DELAY     0x0A  // us: wait
+
+
+// How the end of a byte program is detected
+#define DONE_READY  0  // READY (RY/BY#) pin goes high
+#define DONE_POLL   1  // DQ7 of the programmed byte reads as the data (data polling)
+
+// Command set of a flash chip family. The addresses are byte mode addresses.
+typedef struct {
+    uint16_t unlock1;     // address of the 1st and 3rd cycle (0xAA, command)
+    uint16_t unlock2;     // address of the 2nd cycle (0x55)
+    uint16_t idAddr;      // manufacturer ID in the autoselect mode
+    uint8_t devOffset;    // device ID location relative to idAddr
+    uint8_t program;      // program command
+    uint8_t erase;        // erase setup command, followed by another unlock and:
+    uint8_t chipErase;
+    uint8_t sectorErase;
+    uint8_t done;         // DONE_*
+} FlashAlg;
+
+// The entry 0 is the default: AMD compatible 29F800 / 29F400 chips in byte mode,
+// programmed by the optimised writeData() and writeDataSlow().
+#define ALG_AMD    0
+#define ALG_JEDEC  1
+static __code const FlashAlg algs[] = {
+    { 0x0AAA, 0x0555, 0x0100, 2, 0xA0, 0x80, 0x10, 0x30, DONE_READY },
+    // JEDEC x8 chips (SST 39SF, Winbond W39): no RY/BY# pin
+    { 0x5555, 0x2AAA, 0x0000, 1, 0xA0, 0x80, 0x10, 0x30, DONE_POLL },
+};
+
+// Chip families by the manufacturer ID (and device ID, 0 matches all devices)
+typedef struct {
+    uint8_t manufId;
+    uint8_t deviceId;
+    uint8_t alg;
+} FlashChip;
+
+static __code const FlashChip chipAlgs[] = {
+    { 0x01, 0, ALG_AMD },     // AMD / Spansion
+    { 0x04, 0, ALG_AMD },     // Fujitsu
+    { 0xC2, 0, ALG_AMD },     // Macronix
+    { 0xBF, 0, ALG_JEDEC },   // SST
+    { 0xDA, 0, ALG_JEDEC },   // Winbond
+};
 
 // Controls the direction of the data port P1: eiter input (for reading) or output (for writing)
 #define P1_DATA_OUT P1_DIR_PU = 0xFF
 #define P1_DATA_IN  P1_DIR_PU = 0 
 
-uint8_t rwBuffer[64];  //buffer for payload data transferred over USB
+// Buffer for payload data transferred over USB. It sits in xRAM right after
+// the Ep0Buffer (0x0000): the endpoint DMA receives the write packets directly
+// to it. The Makefile places the other xdata variables after it (XRAM_LOC).
+#define RW_BUFFER_ADDR 0x0040
+__xdata __at (RW_BUFFER_ADDR) uint8_t rwBuffer[64];
+uint8_t rwDma = 0;     //set while the EP0 DMA points to rwBuffer
+__xdata uint8_t scCapture[64]; //bytes read by a script, returned via rwBuffer
+uint8_t rwLen = 64;    //number of valid bytes in rwBuffer to be written
+uint8_t rdLen = 64;    //number of bytes to read to rwBuffer
+uint8_t rdBlocks = 1;  //maximum number of 64 byte blocks covered by a compressed read
+uint8_t rdShift = 6;   //log2 of the size of the range summed by a checksum read
 
 uint8_t command = 0;   //main command to execure: read / write /erase etc.
 uint8_t addrBank = 0;  //top 4 bits of the 20bit address
@@ -129,10 +243,54 @@ uint8_t ctrl = 0;      //control register - holds OE, WE, SH1B and LED bits
 uint8_t data = 0;      //generic parameter set via usb interface
 uint8_t status = 0;    //status of the read/write operation, sent back to the USB host 
 
+// the byte programming loops take the data from rwBuffer[wrPos] and advance wrPos by wrStep:
+// 1 for the plain data, 0 for a run of a single value (RLE)
+uint8_t wrPos = 0;     //index of the next byte to be programmed
+uint8_t wrLen = 0;     //number of bytes to be programmed
+uint8_t wrStep = 1;
+uint8_t progH = 0;     //middle 8 bits of the address being programmed
+uint8_t progL = 0;     //low 8 bits of the address being programmed
+
+// durations of the operations, returned by CMD_GET_DATA subcommand 2
+uint16_t eraseTime = 0; //duration of the last erase in 10 ms units
+uint32_t progTime = 0;  //programming time of the written bytes in timer 0 ticks (0.5 us)
+uint16_t progBytes = 0; //number of bytes programmed since the last report
+
+uint8_t alg = ALG_AMD; //command set of the chip selected by the identification
+uint8_t manufId = 0;   //IDs read by the last identification
+uint8_t deviceId = 0;
+
 static uint8_t writeData();
 static void readData();
 static void setShiftRegsCtrl();
 
+// Copies 'len' (1 - 64) bytes from rwBuffer to Ep0Buffer in the USB interrupt.
+// Each buffer has its own DPTR (the CH55x has two, selected by DPS) which
+// increments after every movx: ~6 cycles per byte instead of the generic
+// pointer calls of memcpy().
+static void copyToEp0(uint8_t len)
+{
+    len; // passed in dpl
+__asm
+    mov r7, dpl
+    // DPTR0 -> rwBuffer, DPTR1 -> Ep0Buffer
+    mov dptr, #_rwBuffer
+    inc _XBUS_AUX
+    mov dptr, #_Ep0Buffer
+    orl _XBUS_AUX, #0x04 // bDPTR_AUTO_INC
+00001$:
+    // read with DPTR0, write with DPTR1
+    dec _XBUS_AUX
+    movx a, @dptr
+    inc _XBUS_AUX
+    movx @dptr, a
+    djnz r7, 00001$
+
+    // back to DPTR0 without auto increment (used by the compiled code)
+    anl _XBUS_AUX, #0xFA // clear bDPTR_AUTO_INC and DPS
+__endasm;
+}
+
 /*******************************************************************************
 * Jump to bootloader
 *******************************************************************************/
@@ -163,6 +321,16 @@ static uint16_t handleVendorControlTransfer()
     //    - 2 * 8 bits in UsbSetupBuf->wValueL and UsbSetupBuf->wValueH
     //    - 2 * 8 bits in UsbSetupBuf->wIndexL and UsbSetupBuf->wIndexH
 
+    // The data stage of the previous write never arrived (the host aborted
+    // the transfer): this setup packet was received to rwBuffer and the stale
+    // one is in Ep0Buffer. Restore the DMA and reject it. A stalled request
+    // is never executed, so the host repeats it once (see controlTransfer()).
+    if (rwDma) {
+        UEP0_DMA = (uint16_t) Ep0Buffer;
+        rwDma = 0;
+        return 0xFF;
+    }
+
 	switch (UsbIntrSetupReq & 0xF0) {
     //set Shift register data
     case CMD_SET_SHREG : {
@@ -181,11 +349,44 @@ static uint16_t handleVendorControlTransfer()
     } break;
     case CMD_GET_DATA: {
         uint8_t* dst = (uint8_t*) Ep0Buffer;
+        // subcommand 1: unique ID of the MCU, used as a serial number of the programmer
+        if ((UsbIntrSetupReq & 0x0F) == 1) {
+            memcpy(dst, (__code uint8_t*) ROM_CHIP_ID_LO, 4);
+            return 4;
+        }
+        // subcommand 2: durations of the last erase and of the programming
+        // since the last report (the programming counters are restarted)
+        if ((UsbIntrSetupReq & 0x0F) == 2) {
+            dst[0] = eraseTime & 0xFF;
+            dst[1] = eraseTime >> 8;
+            dst[2] = progTime & 0xFF;
+            dst[3] = (progTime >> 8) & 0xFF;
+            dst[4] = (progTime >> 16) & 0xFF;
+            dst[5] = progTime >> 24;
+            dst[6] = progBytes & 0xFF;
+            dst[7] = progBytes >> 8;
+            progTime = 0;
+            progBytes = 0;
+            return 8;
+        }
         *dst = data;
         dst++;
         *dst = status;
         return 2; // transfer 2 bytes back to the host: data & status
     } break;
+    // protocol and firmware version, payload size, number of buffers and features
+    case CMD_GET_CAPS: {
+        uint8_t* dst = (uint8_t*) Ep0Buffer;
+        dst[0] = PROTOCOL_VERSION;
+        dst[1] = FW_VERSION_MAJOR;
+        dst[2] = FW_VERSION_MINOR;
+        dst[3] = sizeof(rwBuffer);
+        dst[4] = RW_BUFFERS;
+        dst[5] = CAPS & 0xFF;
+        dst[6] = CAPS >> 8;
+        dst[7] = 0;
+        return 8;
+    } break;
     //jump to bootloader
     case CMD_BOOTLOADER : {
         jumpToBootloader();
@@ -196,6 +397,10 @@ static uint16_t handleVendorControlTransfer()
         addrL = UsbSetupBuf->wValueL;
         addrBank = UsbSetupBuf->wIndexL << 4;
         data = UsbSetupBuf->wIndexH;
+        // the map (test result) is made by the main loop: busy until it is in rwBuffer
+        if (data == SETUP_ID_MAP || data == SETUP_SELF_TEST) {
+            status = CMD_SET_UP;
+        }
         command = CMD_SET_UP;
     } break;
 
@@ -204,19 +409,72 @@ static uint16_t handleVendorControlTransfer()
         addrL = UsbSetupBuf->wValueL;
         addrBank = UsbSetupBuf->wIndexL << 4;
         data = UsbSetupBuf->wIndexH;
+        // the last chunk of a file may be shorter than 64 bytes
+        rwLen = UsbSetupBuf->wLengthL;
+        if (rwLen > 64) {
+            rwLen = 64;
+        }
+        // receive the data directly to rwBuffer, no copying in the interrupt
+        UEP0_DMA = RW_BUFFER_ADDR;
+        rwDma = 1;
         // just wait for the data and confirm the transfer
     } break;
+    // the script is received directly to rwBuffer like the write packets
+    case CMD_SCRIPT: {
+        rwLen = UsbSetupBuf->wLengthL;
+        if (rwLen > 64) {
+            rwLen = 64;
+        }
+        UEP0_DMA = RW_BUFFER_ADDR;
+        rwDma = 1;
+    } break;
     case CMD_READ: {
+        // subcommand 2: compressed read of up to wIndexH blocks
+        if ((UsbIntrSetupReq & 0xF) == 2) {
+            addrH = UsbSetupBuf->wValueH;
+            addrL = UsbSetupBuf->wValueL;
+            addrBank = UsbSetupBuf->wIndexL << 4;
+            rdBlocks = UsbSetupBuf->wIndexH;
+            if (rdBlocks == 0) {
+                rdBlocks = 1;
+            }
+            rdLen = 64;
+            command = CMD_READ_RLE;
+            return 0;
+        } else
+        // subcommand 3: checksum of an aligned range of 2^wIndexH bytes
+        // subcommand 4: CRC-16 of the same range
+        if ((UsbIntrSetupReq & 0xF) == 3 || (UsbIntrSetupReq & 0xF) == 4) {
+            addrH = UsbSetupBuf->wValueH;
+            addrL = UsbSetupBuf->wValueL;
+            addrBank = UsbSetupBuf->wIndexL << 4;
+            rdShift = UsbSetupBuf->wIndexH;
+            if (rdShift < 6) {
+                rdShift = 6;
+            }
+            if (rdShift > 20) {
+                rdShift = 20;
+            }
+            // summing large ranges takes long: busy until the main loop finishes
+            status = CMD_READ;
+            command = ((UsbIntrSetupReq & 0xF) == 3) ? CMD_READ_SUM : CMD_READ_CRC;
+            return 0;
+        } else
         if ((UsbIntrSetupReq & 0xF) == 0) {
             addrH = UsbSetupBuf->wValueH;
             addrL = UsbSetupBuf->wValueL;
             addrBank = UsbSetupBuf->wIndexL << 4;
+            // number of bytes to read, 0 means the full buffer
+            rdLen = UsbSetupBuf->wIndexH;
+            if (rdLen == 0 || rdLen > 64) {
+                rdLen = 64;
+            }
             //last addr is erased in SETUP_READ
             command = CMD_READ;
             return 0; 
         } else {
-            memcpy(Ep0Buffer, rwBuffer, 64);
-            return 64;
+            copyToEp0(rdLen);
+            return rdLen;
         }
     } break;
 	default:
@@ -228,10 +486,22 @@ static uint16_t handleVendorControlTransfer()
 
 static void handleVendorDataTransfer()
 {
+    // The data were received to rwBuffer: the next setup packet goes to Ep0Buffer
+    UEP0_DMA = (uint16_t) Ep0Buffer;
+    rwDma = 0;
+
     // Ah! The data to write just arrived.
     if (CMD_WRITE == UsbIntrSetupReq) {
-        memcpy(rwBuffer, Ep0Buffer, 64);
         command = data ? CMD_WRITE_SLOW: CMD_WRITE;
+    } else
+    // RLE packet: decoded by the main loop, 'data' keeps the slow flag
+    if (CMD_WRITE_RLE == UsbIntrSetupReq) {
+        command = CMD_WRITE_RLE;
+    } else
+    // the host polls the status until the script finishes
+    if (CMD_SCRIPT == UsbIntrSetupReq) {
+        status = STATUS_SCRIPT;
+        command = CMD_SCRIPT;
     }
 }
 
@@ -601,17 +871,24 @@ static void writeByte(uint16_t a, uint8_t d)
     FLCE = 1;
 }
 
-// Writes a buffer of 64 bytes to flash.
+// Moves to the next 64k bank: the top address bits are set via the control register.
+static void nextAddrBank()
+{
+    addrBank += 0x10;
+    ctrl &= 0x0F; // clear top address bits
+    ctrl |= (addrBank);
+    setShiftRegsCtrl();
+}
+
+// Writes 'wrLen' bytes of the buffer (see wrPos, wrStep) to flash.
+// The data may start at any address and cross 256 byte boundaries.
 // This function does not use READY signal for checking whether
 // the IC is ready to write another byte. Therefore we give enough
 // time assuming the IC wrote the previous byte OK. If the flash 
 // chip is very slow we might get errors.
 static uint8_t writeDataSlow()
 {
-    uint8_t i = 0;
-    //note: addr and addrBank must be already set
-    uint8_t addrProgL = addrL;
-    uint8_t addrProgH = addrH;
+    //note: progH, progL and addrBank must be already set
     uint8_t waitCnt;
 
     //ensure the direction of all pins of the data port is Out 
@@ -627,7 +904,7 @@ static uint8_t writeDataSlow()
 
     //WE# low - must be already set (via Setup command, before bulk write)
 
-    while (i < 64)
+    while (wrLen)
     {
         //wait for ready high 
         //while (!READY){}
@@ -691,14 +968,14 @@ static uint8_t writeDataSlow()
         //addr is now 0xAAA
 
         // Now write the actual byte to the flash memory
-        addrL = addrProgL;
-        addrH = addrProgH;
+        addrL = progL;
+        addrH = progH;
         setShiftRegsAddr();
         
         //set LOW - address is latched    
         FLCE = 0;
         // set the data bus
-        P1 = rwBuffer[i];
+        P1 = rwBuffer[wrPos];
         __asm
          nop __endasm;
         //set HI - data is latched
@@ -726,8 +1003,16 @@ static uint8_t writeDataSlow()
         }
 
         //switch to the next address
-        addrProgL++;
-        i++;
+        progL++;
+        wrPos += wrStep;
+        wrLen--;
+        //crossing 256 byte boundary: carry to the middle and the top address bits
+        if (progL == 0) {
+            progH++;
+            if (progH == 0) {
+                nextAddrBank();
+            }
+        }
 
         //mDelaymS(50); //for LED debug
     }
@@ -736,16 +1021,14 @@ static uint8_t writeDataSlow()
     return 0;
 }
 
-// Writes a buffer of 64 bytes to flash.
+// Writes 'wrLen' bytes of the buffer (see wrPos, wrStep) to flash.
+// The data may start at any address and cross 256 byte boundaries.
 // This function uses READY signal for checking whether
 // the IC is ready to write another byte. 
 static uint8_t writeData()
 {
-    uint8_t i = 0;
     uint8_t safetyCnt;
-    //note: addr and addrBank must be already set
-    uint8_t addrProgL = addrL;
-    uint8_t addrProgH = addrH;
+    //note: progH, progL and addrBank must be already set
 
     //ensure the direction of all pins of the data port is Out 
     P1_DATA_OUT;
@@ -759,7 +1042,7 @@ static uint8_t writeData()
 
     //WE# low - must be already set (via Setup command, before bulk write)
 
-    while (i < 64)
+    while (wrLen)
     {
 
         //magic sequence: "write byte" 0xAAA:0xAA , 0x555:0x55, 0xAAA:0xA0
@@ -831,22 +1114,30 @@ static uint8_t writeData()
         //addr is now 0xAAA
 
         // Now write the actual byte to the flash memory
-        addrL = addrProgL;
-        addrH = addrProgH;
+        addrL = progL;
+        addrH = progH;
         setShiftRegsAddr();
         
         //set LOW - address is latched    
         FLCE = 0;
         // set the data bus
-        P1 = rwBuffer[i];
+        P1 = rwBuffer[wrPos];
         __asm
          nop __endasm;
         //set HI - data is latched
         FLCE = 1;
 
         //switch to next address 
-        addrProgL++;
-        i++;
+        progL++;
+        wrPos += wrStep;
+        wrLen--;
+        //crossing 256 byte boundary: carry to the middle and the top address bits
+        if (progL == 0) {
+            progH++;
+            if (progH == 0) {
+                nextAddrBank();
+            }
+        }
 
         //mDelaymS(1);
         //mDelaymS(50); //for LED debug
@@ -867,6 +1158,187 @@ static uint8_t writeData()
     return 0;
 }
 
+// Writes one bus cycle of a command sequence: the byte 'd' to the address 'a'
+// of the current bank. WE# is held low by the write setup, CE# latches the data.
+static void writeCycle(uint16_t a, uint8_t d)
+{
+    addrH = a >> 8;
+    addrL = a & 0xFF;
+    setShiftRegsAddr();
+    FLCE = 0;
+    P1 = d;
+    __asm nop
+     nop __endasm;
+    FLCE = 1;
+}
+
+// Data polling: waits until DQ7 of the programmed byte reads as bit 7 of 'd'.
+// The address of the byte must be set. Returns 1 on a timeout.
+static uint8_t pollData(uint8_t d)
+{
+    uint8_t safetyCnt = 0xFF;
+    uint8_t v;
+
+    // switch to reading: WE# high, OE# low
+    P1_DATA_IN;
+    ctrl |= CTRL_WE;
+    ctrl &= ~CTRL_OE;
+    setShiftRegsCtrl();
+    do {
+        FLCE = 0;
+        __asm nop
+         nop __endasm;
+        v = P1;
+        FLCE = 1;
+        safetyCnt--;
+    } while (((v ^ d) & 0x80) && safetyCnt);
+
+    // back to writing
+    ctrl |= CTRL_OE;
+    ctrl &= ~CTRL_WE;
+    setShiftRegsCtrl();
+    P1_DATA_OUT;
+    return safetyCnt ? 0 : 1;
+}
+
+// Writes 'wrLen' bytes of the buffer (see wrPos, wrStep) with the command set
+// of the selected algorithm. Slower than writeData(): all addresses of the
+// command sequence are shifted in full.
+static uint8_t writeDataAlg(uint8_t slow)
+{
+    uint8_t waitCnt;
+    //note: progH, progL and addrBank must be already set
+
+    P1_DATA_OUT;
+    ctrl &= ~CTRL_SH1B;
+    ctrl &= 0x0F; // clear top address bits
+    ctrl |= (addrBank); //set top-most address bits from the address bank
+    setShiftRegsCtrl();
+
+    while (wrLen)
+    {
+        writeCycle(algs[alg].unlock1, 0xAA);
+        writeCycle(algs[alg].unlock2, 0x55);
+        writeCycle(algs[alg].unlock1, algs[alg].program);
+        writeCycle((progH << 8) | progL, rwBuffer[wrPos]);
+
+        if (slow) {
+            // READY pin not connected: ~5us or longer, as writeDataSlow() does
+            waitCnt = 8;
+            while (waitCnt--) {
+                __asm nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop
+                nop __endasm;
+            }
+        } else
+        if (algs[alg].done == DONE_POLL) {
+            if (pollData(rwBuffer[wrPos])) {
+                return 1;
+            }
+        } else {
+            waitCnt = 0xFF;
+            while (!FLREADY && waitCnt) {
+                waitCnt--;
+            }
+            if (!waitCnt) {
+                return 1;
+            }
+        }
+
+        //switch to next address
+        progL++;
+        wrPos += wrStep;
+        wrLen--;
+        if (progL == 0) {
+            progH++;
+            if (progH == 0) {
+                nextAddrBank();
+            }
+        }
+    }
+    return 0;
+}
+
+// Programs the prepared bytes with the algorithm of the chip. The AMD
+// command set keeps the fast kernels. The time spent is added to progTime.
+static uint8_t programData(uint8_t slow)
+{
+    uint8_t len = wrLen;
+    uint8_t ret;
+
+    TR0 = 0;
+    TL0 = 0;
+    TH0 = 0;
+    TF0 = 0;
+    TR0 = 1;
+    if (alg != ALG_AMD) {
+        ret = writeDataAlg(slow);
+    } else {
+        ret = slow ? writeDataSlow() : writeData();
+    }
+    TR0 = 0;
+    // one call takes ~1 ms at most: an overflow means a stuck chip
+    progTime += TF0 ? 0xFFFF : ((TH0 << 8) | TL0);
+    progBytes += len;
+    return ret;
+}
+
+// Decodes the RLE packet in rwBuffer and programs the data. Each token is
+// either 0..0x7F: 1..128 literal bytes follow, or 0x80..0xFF: the next byte
+// is repeated 1..128 times. Runs of 0xFF (the erased state) are skipped.
+// Returns 1 when the packet is malformed or the flash chip is not ready.
+static uint8_t writeRle(uint8_t slow)
+{
+    uint8_t i = 0;
+    uint8_t t;
+    uint8_t ret = 0;
+
+    progL = addrL;
+    progH = addrH;
+    while (i < rwLen && ret == 0) {
+        t = rwBuffer[i++];
+        wrLen = (t & 0x7F) + 1;
+        wrPos = i;
+        if (t & 0x80) {
+            wrStep = 0;
+            i++;
+        } else {
+            wrStep = 1;
+            i += wrLen;
+        }
+        if (i > rwLen) {
+            return 1;
+        }
+        if (wrStep == 0 && rwBuffer[wrPos] == 0xFF) {
+            // nothing to program: move the address past the run
+            t = progL;
+            progL += wrLen;
+            if (progL < t) {
+                progH++;
+                if (progH == 0) {
+                    addrBank += 0x10;
+                }
+            }
+            continue;
+        }
+        ret = programData(slow);
+    }
+    return ret;
+}
+
 // Reads a single byte from an address. This is not optimised for
 // speed, so use it only for non time-critical stuff.
 static void readByte(uint16_t a)
@@ -895,7 +1367,8 @@ static void readByte(uint16_t a)
     FLCE = 1;
 }
 
-// Reads 64 bytes of data from the flash chip into the rwBuffer. 
+// Reads 'rdLen' bytes (up to 64) of data from the flash chip into the rwBuffer.
+// The data may start at any address and cross 256 byte boundaries.
 static void readData()
 {
     uint8_t i = 0;
@@ -910,7 +1383,7 @@ static void readData()
     // CTRL_OE must be already low (via PC setup command)!
     // Note - CE low/high will also toggle OE low/high because of the OR gate
 
-    while (i < 64) // len
+    while (i < rdLen) // len
     {
         //mDelaymS(50); //for LED debug
         //set Flash Chip Enable LOW    
@@ -928,20 +1401,166 @@ static void readData()
         FLCE = 1;
 
         //Set next address - set only Low 8 bits to be as quick as possible.
-        //Note: we always read the initial address aligned on 64 byte boundaries
-        //therefore the address change will never spill over to middle address bits 8..15 
-        setShiftRegsAddrLow();
+        //When the address spills over to the middle address bits 8..15 (rarely)
+        //set the whole address and disable U2 clocking again.
+        if (addrL) {
+            setShiftRegsAddrLow();
+        } else {
+            addrH++;
+            if (addrH == 0) {
+                addrBank += 0x10;
+            }
+            setAddr();
+            ctrl |= CTRL_SH1B;
+            setShiftRegsCtrl();
+        }
     }
 
     //CTRL_OE is set High at the end of the whole readinging 
 }
 
+// Checks whether all 64 bytes of the rwBuffer have the same value
+static uint8_t blockUniform()
+{
+    uint8_t i;
+    uint8_t v = rwBuffer[0];
+
+    for (i = 1; i < 64; i++) {
+        if (rwBuffer[i] != v) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Compressed read: a block with mixed data is returned as it is (64 bytes).
+// A run of blocks filled with one value (blank or padded areas) is returned
+// as 2 bytes: the number of blocks and the value.
+static void readDataRle()
+{
+    uint8_t n = 1;
+    uint8_t v;
+
+    readData();
+    if (!blockUniform()) {
+        return;
+    }
+    v = rwBuffer[0];
+    // readData() leaves the address at the next block
+    while (n < rdBlocks) {
+        readData();
+        if (!blockUniform() || rwBuffer[0] != v) {
+            break;
+        }
+        n++;
+    }
+    rwBuffer[0] = n;
+    rwBuffer[1] = v;
+    rdLen = 2;
+}
+
+// CRC-16 (polynomial 0x1021, MSB first) of all byte values
+static __code const uint16_t crcTable[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+// Checksum of 2^rdShift bytes (64 bytes up to 1 Mbyte) from the address.
+// Sum: A is the sum of the bytes, B the sum of the A values, both 16 bit
+// without modulo. The host computes the same sums from the file (and derives
+// the sums of the second half of a range from the first half). Differences
+// can cancel out in the sums (+1 in one byte, -1 in another).
+// CRC: CRC-16 with the initial value 0xFFFF, it catches such differences.
+// The result is returned in rwBuffer: A low, A high, B low, B high or
+// CRC low, CRC high.
+static void readChecksum(uint8_t crc)
+{
+    uint16_t blocks = 1 << (rdShift - 6);
+    uint16_t sumA = crc ? 0xFFFF : 0;
+    uint16_t sumB = 0;
+    uint8_t i;
+    uint8_t v;
+
+    //note: addr and addrBank must be already set
+    setAddr();
+    ctrl |= CTRL_SH1B;
+    setShiftRegsCtrl();
+
+    while (blocks) {
+        i = 64;
+        while (i) {
+            FLCE = 0;
+            addrL++;
+            __asm nop __endasm;
+            v = P1;
+            FLCE = 1;
+            if (crc) {
+                sumA = (sumA << 8) ^ crcTable[(sumA >> 8) ^ v];
+            } else {
+                sumA += v;
+                sumB += sumA;
+            }
+            i--;
+
+            //next address, see readData()
+            if (addrL) {
+                setShiftRegsAddrLow();
+            } else {
+                addrH++;
+                if (addrH == 0) {
+                    addrBank += 0x10;
+                }
+                setAddr();
+                ctrl |= CTRL_SH1B;
+                setShiftRegsCtrl();
+            }
+        }
+        blocks--;
+    }
+    rwBuffer[0] = sumA & 0xFF;
+    rwBuffer[1] = sumA >> 8;
+    rwBuffer[2] = sumB & 0xFF;
+    rwBuffer[3] = sumB >> 8;
+    rdLen = crc ? 2 : 4;
+}
+
 // Waits till the erase procedure is finished. It also blinks a LED during erasing.
+// The duration is stored to eraseTime.
 static void waitForErase()
 {
-    uint8_t cnt = 100; // wait up to 10 seconds
+    uint16_t cnt = 1000; // wait up to 10 seconds
 
-    mDelaymS(50);
+    mDelaymS(10);
 
     P1_DATA_IN;
     // erase does not take longer than few seconds
@@ -956,15 +1575,16 @@ static void waitForErase()
     while (data != 0xFF && cnt)
     {
         //blink LED. Note register is set during read byte
-        if (cnt & 0x1) {
+        if (cnt & 0x8) {
             ctrl |= CTRL_LED1;
         } else {
             ctrl &= ~CTRL_LED1;
         }
         readByte(1);
-        mDelaymS(100);
+        mDelaymS(10);
         cnt--;
     }
+    eraseTime = 1001 - cnt;
 
     // turn LED1 on 
     ctrl |= CTRL_LED1;
@@ -974,6 +1594,343 @@ static void waitForErase()
     status = cnt ? STATUS_INITIALISED : STATUS_ERASE_FAIL;
 }
 
+// Waits up to 'ms' milliseconds for the chip: either for the READY signal or
+// (with 'poll' set) for DQ7 of the byte at the current address to be equal
+// to bit 7 of 'd' (data polling). Returns 0 when ready.
+static uint8_t scriptWait(uint8_t poll, uint8_t d, uint8_t ms)
+{
+    uint16_t cnt = (uint16_t) ms * 100; // 10 us steps
+
+    while (1) {
+        if (poll) {
+            readByte(0);
+            if (((data ^ d) & 0x80) == 0) {
+                return 0;
+            }
+        } else
+        if (FLREADY) {
+            return 0;
+        }
+        if (cnt == 0) {
+            return 1;
+        }
+        mDelayuS(10);
+        cnt--;
+    }
+}
+
+// number of operand bytes of each script opcode
+static __code const uint8_t opSize[] = { 0, 3, 1, 3, 0, 0, 1, 2, 1, 0, 1 };
+
+// Runs the bus script received to rwBuffer. The bytes read by the script
+// are returned in rwBuffer (fetched by the READ subcommand 1), their count
+// in 'data'. An unknown opcode or a wait timeout stops the script.
+static void runScript()
+{
+    uint8_t pc = 0;
+    uint8_t loopPc = 0;
+    uint8_t loopCnt = 0;
+    uint8_t capLen = 0;
+    uint8_t fail = 0;
+    uint8_t op;
+
+    // start from the idle bus: WE and OE high
+    ctrl |= CTRL_WE | CTRL_OE;
+    setShiftRegsCtrl();
+
+    while (pc < rwLen && !fail) {
+        op = rwBuffer[pc++];
+        if (op >= sizeof(opSize) || pc + opSize[op] > rwLen) {
+            fail = 1;
+            break;
+        }
+        switch (op) {
+        case OP_END:
+            pc = rwLen;
+            break;
+        case OP_ADDR:
+            addrBank = rwBuffer[pc] << 4;
+            addrH = rwBuffer[pc + 1];
+            addrL = rwBuffer[pc + 2];
+            break;
+        case OP_WRITE:
+            P1_DATA_OUT;
+            writeByte(0, rwBuffer[pc]);
+            break;
+        case OP_WRITE16:
+            addrBank = 0;
+            addrH = rwBuffer[pc];
+            addrL = rwBuffer[pc + 1];
+            P1_DATA_OUT;
+            writeByte(0, rwBuffer[pc + 2]);
+            break;
+        case OP_READ:
+            P1_DATA_IN;
+            readByte(0);
+            if (capLen < sizeof(scCapture)) {
+                scCapture[capLen++] = data;
+            }
+            break;
+        case OP_INC:
+            addrL++;
+            if (addrL == 0) {
+                addrH++;
+                if (addrH == 0) {
+                    addrBank += 0x10;
+                }
+            }
+            break;
+        case OP_WAIT_RDY:
+            fail = scriptWait(0, 0, rwBuffer[pc]);
+            break;
+        case OP_POLL:
+            P1_DATA_IN;
+            fail = scriptWait(1, rwBuffer[pc], rwBuffer[pc + 1]);
+            break;
+        case OP_LOOP:
+            loopCnt = rwBuffer[pc];
+            loopPc = pc + 1;
+            break;
+        case OP_NEXT:
+            loopCnt--;
+            if (loopCnt) {
+                pc = loopPc;
+                continue;
+            }
+            break;
+        case OP_DELAY:
+            mDelayuS(rwBuffer[pc]);
+            break;
+        }
+        pc += opSize[op];
+    }
+
+    P1_DATA_IN;
+    for (op = 0; op < capLen; op++) {
+        rwBuffer[op] = scCapture[op];
+    }
+    rdLen = capLen ? capLen : 1;
+    data = capLen;
+    status = fail ? STATUS_SCRIPT_FAIL : STATUS_INITIALISED;
+}
+
+// Reads the IDs in the autoselect mode with each command set until they match
+// a known chip family, which selects the algorithm. Unknown chips keep the
+// default algorithm and the IDs read with it.
+static void identify()
+{
+    uint8_t a, i;
+    uint8_t m0 = 0;
+    uint8_t d0 = 0;
+
+    for (a = 0; a < sizeof(algs) / sizeof(algs[0]); a++) {
+        P1_DATA_OUT;
+        writeByte(algs[a].unlock1, 0xAA);
+        writeByte(algs[a].unlock2, 0x55);
+        writeByte(algs[a].unlock1, 0x90);
+
+        P1_DATA_IN;
+        addrBank = 0;
+        addrH = algs[a].idAddr >> 8;
+        addrL = algs[a].idAddr & 0xFF;
+        readByte(0);
+        manufId = data;
+        addrL += algs[a].devOffset;
+        readByte(0);
+        deviceId = data;
+
+        //leave the autoselect mode
+        P1_DATA_OUT;
+        writeByte(0x0f, 0xf0);
+
+        if (a == ALG_AMD) {
+            m0 = manufId;
+            d0 = deviceId;
+        }
+        for (i = 0; i < sizeof(chipAlgs) / sizeof(chipAlgs[0]); i++) {
+            if (chipAlgs[i].alg == a && chipAlgs[i].manufId == manufId &&
+                (chipAlgs[i].deviceId == 0 || chipAlgs[i].deviceId == deviceId)) {
+                alg = a;
+                return;
+            }
+        }
+    }
+    alg = ALG_AMD;
+    manufId = m0;
+    deviceId = d0;
+}
+
+// Reads the IDs and the protection of the whole chip into rwBuffer: the
+// manufacturer ID, the device ID and 16 bytes of the map. In the autoselect
+// mode the byte 4 of a sector reads 1 when the sector is protected: it is
+// read from every 8 kbytes (bit i & 7 of the byte i >> 3 for the addresses
+// from i * 8192), the host knows the sector layout.
+static void readIdMap()
+{
+    uint8_t unit = 0;
+
+    identify();
+    memset(rwBuffer, 0, 18);
+    rwBuffer[0] = manufId;
+    rwBuffer[1] = deviceId;
+
+    P1_DATA_OUT;
+    writeByte(algs[alg].unlock1, 0xAA);
+    writeByte(algs[alg].unlock2, 0x55);
+    writeByte(algs[alg].unlock1, 0x90);
+
+    P1_DATA_IN;
+    while (unit < 128) {
+        addrBank = (unit << 1) & 0xF0;
+        addrH = (unit & 7) << 5;
+        addrL = 4;
+        readByte(0);
+        if (data & 1) {
+            rwBuffer[2 + (unit >> 3)] |= 1 << (unit & 7);
+        }
+        unit++;
+    }
+
+    //leave the autoselect mode
+    P1_DATA_OUT;
+    writeByte(0x0f, 0xf0);
+    rdLen = 18;
+}
+
+// Walks a zero and a one over the data bus with the chip deselected. The lines
+// are quasi-bidirectional: the lines written as 1 are held high by the weak
+// pull-ups only, so a stuck or shorted line reads differently from the pattern.
+static void testDataBus()
+{
+    uint8_t i, bit, v, low;
+
+    FLCE = 1;
+    P1_MOD_OC = 0xFF;
+    P1_DIR_PU = 0xFF;
+
+    P1 = 0xFF;
+    mDelayuS(10);
+    low = ~P1;
+    rwBuffer[TEST_DATA_LOW] = low;
+    for (i = 0; i < 8; i++) {
+        bit = 1 << i;
+        // walking zero: only the driven line may read low
+        P1 = ~bit;
+        mDelayuS(10);
+        v = P1;
+        if (v & bit) {
+            rwBuffer[TEST_DATA_HIGH] |= bit;
+        }
+        v = ~v & ~bit & ~low;
+        if (v) {
+            rwBuffer[TEST_DATA_SHORT] |= v | bit;
+        }
+        // walking one: the released line must rise between the driven ones
+        P1 = bit;
+        mDelayuS(10);
+        if (!(P1 & bit) && !(low & bit)) {
+            rwBuffer[TEST_DATA_SHORT] |= bit;
+        }
+    }
+
+    P1_MOD_OC = 0;
+    P1_DATA_OUT;
+    P1 = 0;
+}
+
+// Reads the byte at the ID address with the byte address line 'line' inverted
+// (0xFF: none)
+static void readIdLine(uint8_t line)
+{
+    addrBank = 0;
+    addrH = algs[alg].idAddr >> 8;
+    addrL = algs[alg].idAddr & 0xFF;
+    if (line < 8) {
+        addrL ^= 1 << line;
+    } else
+    if (line < 16) {
+        addrH ^= 1 << (line - 8);
+    } else
+    if (line < 20) {
+        addrBank = 0x10 << (line - 16);
+    }
+    readByte(0);
+}
+
+// Probes the address lines with the ID reads of the autoselect mode. Most
+// address lines are ignored by the chip there: inverting them must still
+// read the manufacturer ID. A0 selects the device ID and A1 the protection
+// status, A6 is not tested. A stuck A0 or A1 or a line shorted to them reads
+// the wrong byte. Only the AMD command set is known well enough.
+static void testAddrBus()
+{
+    uint8_t line, expect;
+    uint8_t arrayManuf, arrayDevice;
+
+    if (alg != ALG_AMD) {
+        rwBuffer[TEST_FLAGS] |= TEST_ADDR_SKIPPED;
+    }
+
+    // the array data at the ID addresses tell whether the autoselect works
+    P1_DATA_IN;
+    readIdLine(0xFF);
+    arrayManuf = data;
+    addrL += algs[alg].devOffset;
+    readByte(0);
+    arrayDevice = data;
+
+    P1_DATA_OUT;
+    writeByte(algs[alg].unlock1, 0xAA);
+    writeByte(algs[alg].unlock2, 0x55);
+    writeByte(algs[alg].unlock1, 0x90);
+
+    P1_DATA_IN;
+    readIdLine(0xFF);
+    rwBuffer[TEST_MANUF_ID] = data;
+    addrL += algs[alg].devOffset;
+    readByte(0);
+    rwBuffer[TEST_DEVICE_ID] = data;
+
+    if (rwBuffer[TEST_MANUF_ID] == arrayManuf && rwBuffer[TEST_DEVICE_ID] == arrayDevice) {
+        rwBuffer[TEST_FLAGS] |= TEST_NO_AUTOSELECT;
+    } else
+    for (line = 0; line < 20 && alg == ALG_AMD; line++) {
+        if (line == 7) {
+            continue;
+        }
+        readIdLine(line);
+        expect = (line == 1) ? rwBuffer[TEST_DEVICE_ID] : rwBuffer[TEST_MANUF_ID];
+        if ((line == 2) ? (data & 0xFE) != 0 : data != expect) {
+            rwBuffer[TEST_ADDR + (line >> 3)] |= 1 << (line & 7);
+        }
+    }
+
+    //leave the autoselect mode
+    P1_DATA_OUT;
+    writeByte(0x0f, 0xf0);
+}
+
+// Checks the programmer and the module: the data bus, READY, the unlock
+// cycles (WE# and CE#) and the address lines. The result is in rwBuffer.
+static void selfTest()
+{
+    memset(rwBuffer, 0, TEST_SIZE);
+
+    // the chip was reset by runSetUp(): it must be ready
+    if (!FLREADY) {
+        rwBuffer[TEST_FLAGS] |= TEST_RDY_LOW;
+    }
+    testDataBus();
+    identify();
+    testAddrBus();
+
+    addrH = 0;
+    addrL = 0;
+    addrBank = 0;
+    setAddr();
+    rdLen = TEST_SIZE;
+}
+
 // Set up the Flash chip for different operations based on the value in 'data' variable.
 static void runSetUp() {
 
@@ -1003,6 +1960,18 @@ static void runSetUp() {
         return;
     }
 
+    //the status stays busy until the map is complete
+    if (data == SETUP_ID_MAP) {
+        readIdMap();
+        status = STATUS_INITIALISED;
+        return;
+    }
+    if (data == SETUP_SELF_TEST) {
+        selfTest();
+        status = STATUS_INITIALISED;
+        return;
+    }
+
     status = STATUS_INITIALISED;
     
     if (data == SETUP_READ) {
@@ -1017,6 +1986,8 @@ static void runSetUp() {
     } else
     if (data == SETUP_WRITE) {
         //lastAddr = 0xFFFF;
+        progTime = 0;
+        progBytes = 0;
         //set write enable LOW (active)    
         ctrl &= ~(CTRL_WE );
         // apply controls
@@ -1024,29 +1995,25 @@ static void runSetUp() {
         return;
     }
 
+    //read manufacturer ID or device ID: selects the algorithm of the chip
+    if (data == SETUP_MANUF_ID || data == SETUP_DEVICE_ID) {
+        // 'data' is overwritten by the reads
+        uint8_t manuf = (data == SETUP_MANUF_ID);
+        identify();
+        status = manuf ? 0xF0 : 0xF1;
+        data = manuf ? manufId : deviceId;
+        return;
+    }
+
     //Set up for some more interesting operations...
     P1_DATA_OUT;
     //write a magic sequence:  so called "unlock cycles"
-    writeByte(0xAAA, 0xAA);
-    writeByte(0x1555, 0x55);
-    
-    //read manufacturer ID
-    if (data == SETUP_MANUF_ID) {
-        writeByte(0x2AAA, 0x90);
-        P1_DATA_IN;
-        readByte(0x100);
-        status = 0xF0;
-    }
-    //read device ID 
-    else if (data == SETUP_DEVICE_ID) {
-        writeByte(0x2AAA, 0x90);
-        P1_DATA_IN;
-        readByte(0x102);
-        status = 0xF1;
-    }
+    writeByte(algs[alg].unlock1, 0xAA);
+    writeByte(algs[alg].unlock2, 0x55);
+
     //read sector protection status
-    else if (data == SETUP_SECTOR_VERIFY) {
-        writeByte(0xAAA, 0x90);
+    if (data == SETUP_SECTOR_VERIFY) {
+        writeByte(algs[alg].unlock1, 0x90);
         status = SETUP_SECTOR_VERIFY;
         addrBank = oldAddrBank;
         addrH = oldAddrH;
@@ -1057,24 +2024,24 @@ static void runSetUp() {
     //start chip erase
     else if (data == SETUP_ERASE) {
         status = STATUS_ERASE;
-        writeByte(0xAAA, 0x80);
-        writeByte(0xAAA, 0xAA);
-        writeByte(0x555, 0x55);
-        writeByte(0xAAA, 0x10);
+        writeByte(algs[alg].unlock1, algs[alg].erase);
+        writeByte(algs[alg].unlock1, 0xAA);
+        writeByte(algs[alg].unlock2, 0x55);
+        writeByte(algs[alg].unlock1, algs[alg].chipErase);
 
         waitForErase();
     }
     //start sector erase
     else if (data == SETUP_ERASE_SECTOR) {
         status = STATUS_ERASE;
-        writeByte(0xAAA, 0x80);
-        writeByte(0xAAA, 0xAA);
-        writeByte(0x555, 0x55);
+        writeByte(algs[alg].unlock1, algs[alg].erase);
+        writeByte(algs[alg].unlock1, 0xAA);
+        writeByte(algs[alg].unlock2, 0x55);
         //set the sector address
         addrBank = oldAddrBank;
         addrH = oldAddrH;
         addrL = oldAddrL;
-        writeByte(0, 0x30);
+        writeByte(0, algs[alg].sectorErase);
         waitForErase();
     }
 }
@@ -1089,6 +2056,9 @@ void main() {
     setupGPIO();        
     USBDeviceCfg();
 
+    //timer 0 measures the programming time: 16 bit mode, Fsys / 12
+    TMOD = (TMOD & 0xF0) | bT0_M0;
+
     //initialise the address
     addrH = 0;
     addrL = 0;
@@ -1108,8 +2078,16 @@ void main() {
  
     //poll for received USB commands and execute them
     while (1) {
-        if (command == CMD_WRITE || command == CMD_WRITE_SLOW) {
+        // The host reset the device while the data stage of a write was
+        // pending: the bus reset clears the address, but not the DMA. The
+        // setup packets of the enumeration must go to Ep0Buffer again.
+        if (rwDma && (USB_DEV_AD & MASK_USB_ADDR) == 0) {
+            UEP0_DMA = (uint16_t) Ep0Buffer;
+            rwDma = 0;
+        }
+        if (command == CMD_WRITE || command == CMD_WRITE_SLOW || command == CMD_WRITE_RLE) {
             uint8_t slow = (CMD_WRITE_SLOW == command);
+            uint8_t rle = (CMD_WRITE_RLE == command);
             command = 0;
             status = CMD_WRITE;
 
@@ -1123,9 +2101,21 @@ void main() {
                 ctrl |= (CTRL_LED1);
                 setShiftRegsCtrl();
             }
-            status = (slow) ? writeDataSlow() : writeData();
+            if (rle) {
+                status = writeRle(data);
+            } else {
+                progL = addrL;
+                progH = addrH;
+                wrPos = 0;
+                wrLen = rwLen;
+                wrStep = 1;
+                status = programData(slow);
+            }
         }
-        else if (command == CMD_READ) {
+        else if (command == CMD_READ || command == CMD_READ_RLE || command == CMD_READ_SUM || command == CMD_READ_CRC) {
+            uint8_t rle = (CMD_READ_RLE == command);
+            uint8_t sum = (CMD_READ_SUM == command);
+            uint8_t crc = (CMD_READ_CRC == command);
             command = 0;
             status = CMD_READ;
 
@@ -1141,13 +2131,24 @@ void main() {
             }
 
             P1_DATA_IN;
-            readData();
+            if (sum || crc) {
+                readChecksum(crc);
+            } else
+            if (rle) {
+                readDataRle();
+            } else {
+                readData();
+            }
             status = 0;
         }
         else if (command == CMD_SET_UP) {
             command = 0;
             runSetUp();
         }
+        else if (command == CMD_SCRIPT) {
+            command = 0;
+            runScript();
+        }
      
         // The rest of the commands is only for testing and debugging
 	    else if (command == CMD_SET_SHREG) {
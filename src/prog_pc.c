@@ -24,67 +24,274 @@
  *
  * Build with:
  *
- *      gcc -o prog_pc prog_pc.c -lusb-1.0 
+ *      gcc -O2 -o prog_pc prog_pc.c cf840.c -lusb-1.0 -lpthread
+ *
+ * The programmer itself is driven by the cf840 library (cf840.h),
+ * this file is the command line interface.
  *
  * USB lib API reference:
  *     http://libusb.sourceforge.net/api-1.0
  *
  */
 
+#ifndef MINGW
+#define _GNU_SOURCE  // struct ucred of the daemon socket
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <setjmp.h>
+#include <signal.h>
+#ifndef MINGW
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #ifdef MINGW
 #include <libusbx-1.0/libusb.h>
 #else
 #include <libusb-1.0/libusb.h>
 #endif
 
+#include "cf840.h"
 
+// hotplug filter: the texts are checked by cf840OpenUsb()
 #define VENDOR_ID 0x16c0 
 #define PRODUCT_ID 0x05dc
-#define VENDOR_NAME "github.com/ole00"
-#define PRODUCT_NAME "27cf840_prog"
-
-//see usb1.1 page 183: value bitmap: Host->Device, Vendor request, Recipient is interface
-#define TYPE_OUT_ITF		0x41
 
-//see usb1.1 page 183: value bitmap: Device->Host, Vendor request, Sender is interface
-#define TYPE_IN_ITF		(0x41 | (1 << 7))
-
-
-#define COMMAND_SET_SHREG 0x10
-#define COMMAND_SET_ADDR  0x20
-#define COMMAND_SET_DATA  0x30
-#define COMMAND_GET_DATA  0x40
+#define COMMAND_SET_SHREG CF840_CMD_SET_SHREG
+#define COMMAND_SET_ADDR  CF840_CMD_SET_ADDR
+#define COMMAND_SET_DATA  CF840_CMD_SET_DATA
+#define COMMAND_GET_DATA  CF840_CMD_GET_DATA
 #define COMMAND_WRITE     0x50
 #define COMMAND_READ      0x60
+#define COMMAND_SCRIPT    0x70
 
-#define COMMAND_JUMP_TO_BOOTLOADER 0xB0
+#define COMMAND_JUMP_TO_BOOTLOADER CF840_CMD_BOOTLOADER
 #define COMMAND_SETUP  0xF0
 
 #define SETUP_VERIFY_PROTECT 2
 #define SETUP_ERASE 4
 #define SETUP_SECTOR_ERASE 5
-#define SETUP_READ 6
-#define SETUP_WRITE 7
-#define SETUP_READY 10
 #define SETUP_IDENTIFY 20
 
 #define ACTION_PRINT_HELP			1
 #define ACTION_SET_VERBOSE			2
+#define ACTION_LIST_DEVICES			3
+#define ACTION_DAEMON				4
+#define ACTION_DIFF				5
+#define ACTION_TIMINGS				6
+#define ACTION_COPY				7
+#define ACTION_SELF_TEST			8
+
+// maximum number of programmers driven by one process
+#define MAX_DEVICES 16
+
+// size of the staging buffer used when writing the read data out
+#define OUT_BUF_SIZE (64 * 1024)
+
+// size of the staging buffer used when the written data are streamed from a pipe
+#define IN_BUF_SIZE (4 * 1024)
+
+// number of blocks in flight between the USB thread and the file I/O worker,
+// must be a power of 2. 256 kbytes let the USB transfers ride over disk stalls.
+#define PIPE_BLOCKS 64
+
+// the journal of the write is updated after each block of this size
+#define JOURNAL_BLOCK (4 * 1024)
+
+// options of the journaled write: a resumed write must use the same ones
+#define JOURNAL_ERASE_SECTORS 0x01
+#define JOURNAL_VERIFY        0x02
+#define JOURNAL_SWAP          0x04
+
+// maximum number of durations collected by one action (erased and written sectors)
+#define MAX_SAMPLES 64
+
+// sector of the timing database holding the chip erases
+#define TIMING_CHIP 0xFFFFFFFF
+
+// the firmware gives up an erase after 10 s, the datasheets allow 300 us
+// for programming a byte. The report flags the durations above 70% of the
+// limits or twice the first recorded one.
+#define ERASE_LIMIT_MS 10000
+#define PROGRAM_LIMIT_NS 300000
+#define TIMING_WARN_PERCENT 70
+#define TIMING_DRIFT 2
+
+// the biggest supported flash chip: 20 bit address space
+#define MAX_CHIP_SIZE (1024 * 1024)
+
+// maximum number of banks for reordering
+#define MAX_BANKS 16
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// input file formats
+#define FORMAT_BINARY 0
+#define FORMAT_IHEX 1
+#define FORMAT_SREC 2
+
+// A continuous range of populated bytes in a sparse image
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} Extent;
+
+// Sparse image loaded from a HEX or S-record file.
+// Only the bytes covered by the extents are valid.
+typedef struct {
+    uint8_t* data;
+    Extent* extents;
+    int count;
+    int capacity;
+} SparseImage;
+
+// Input file (image) to be written to the flash chip.
+// Regular files are memory mapped, pipes and stdin are streamed.
+typedef struct {
+    int fd;
+    uint8_t* map;   // contents of the mapped file, NULL when streaming
+    uint32_t size;  // size of the mapped file
+    uint32_t pos;   // current read position
+    uint8_t* data;  // whole streamed input loaded by inputLoad()
+    uint8_t buf[IN_BUF_SIZE]; // staging buffer for streamed data
+} InputFile;
+
+// Output file receiving the read data. The data are placed directly
+// to the staging buffer and written out in large chunks.
+typedef struct {
+    int fd;
+    uint32_t len;  // number of bytes in the staging buffer
+    uint32_t crc;  // CRC32 of the data written so far
+    atomic_int error; // a write failed, the rest of the data is discarded
+    uint8_t buf[OUT_BUF_SIZE] __attribute__((aligned(4096)));
+} OutputFile;
+
+// A block of data passed between the stages of a pipeline
+typedef struct {
+    uint32_t pos;    // chip address (write) or position in the read data
+    uint32_t len;    // 0: end of the data
+    int error;       // the producing stage failed, the data end here
+    uint32_t done;   // bytes of the write job completed when the block came back
+    const uint8_t* data; // writePrefetched(): the data in the image, 'buf' is not used
+    uint8_t buf[IN_BUF_SIZE];
+} Block;
+
+// Single-producer single-consumer lock-free ring of blocks. The indexes run
+// freely: 'head' is written only by the producer, 'tail' only by the consumer.
+// The ring can't overflow, there are only PIPE_BLOCKS blocks in a pipeline.
+typedef struct {
+    Block* slots[PIPE_BLOCKS];
+    atomic_uint head;
+    atomic_uint tail;
+} Ring;
+
+// The USB thread and a worker doing the file I/O, the transforms and the
+// CRC, connected by two rings: the filled blocks go one way, the empty ones
+// come back. The USB thread waits only when all the blocks are in the worker.
+typedef struct {
+    Block blocks[PIPE_BLOCKS];
+    Ring full;
+    Ring empty;
+    atomic_int stop;       // set when the USB thread is done or failed
+    atomic_uint progress;  // last progress of the library: op << 28 | address
+    pthread_t thread;
+    const char* label;     // devLabel of the USB thread
+    void* user;
+} Pipeline;
+
+// Duration reported by the library during an action, see cf840SetTiming()
+typedef struct {
+    int op;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t us;
+} TimingSample;
+
+// A line of the timing database: durations of a sector (or of the chip erases)
+// of a flash module identified by its label and chip ID
+typedef struct {
+    char label[64];       // -label, in a gang followed by '@' and the port path (31 chars each)
+    unsigned manufId;
+    unsigned deviceId;
+    uint32_t sector;      // start address, TIMING_CHIP: the whole chip
+    unsigned erases;      // number of erases including the chip erases
+    unsigned eraseFirst;  // durations of the timed erases in ms
+    unsigned eraseLast;
+    unsigned eraseMax;
+    unsigned writes;      // number of programming samples
+    unsigned progFirst;   // programming time in ns per byte
+    unsigned progLast;
+} TimingRecord;
+
+// A programmer board found on the USB bus
+typedef struct {
+    Cf840Device* dev;
+    const char* path;    // bus and port numbers: stable while the board stays in its port
+    const char* serial;  // unique ID of the CH552 MCU
+    pthread_t thread;  // worker in gang mode
+    int result;
+    double seconds;
+
+    // results of the earlier steps of the session
+    const Cf840ChipInfo* chip;
+    char chipKnown;
+    uint8_t manufId;
+    uint8_t deviceId;
+    char written;      // the CRC32 of the data written by the last -w is known
+    uint32_t wrStart;
+    uint32_t wrLen;
+    uint32_t wrCrc;
+
+    // durations of the current action, saved to the timing database
+    TimingSample samples[MAX_SAMPLES];
+    int sampleCnt;
+} Programmer;
 
-static uint8_t descriptor[256];
+// name of the programmer printed with the messages in gang mode
+static __thread const char* devLabel = NULL;
 
-static uint8_t outBuf[64]; //output (command) buffer
-static uint8_t resBuf[64]; //input (response) buffer
+// programmer running the current action
+static __thread Programmer* current = NULL;
+
+// steps of a session: the arguments are split by '+' and -batch files
+#define MAX_STEPS 256
+typedef struct {
+    int argc;
+    char** argv;
+} Step;
 
 static const char *const strings[2] = { "info", "fatal" };
 
 static char fname[1024];
+static char fname2[1024];
+static char oname[1024];
+static char oname2[1024];
+
+// the second output file is used when the read data are split to even / odd bytes
+static OutputFile outFiles[2];
+
+static uint32_t crcTable[256];
+
+// bankOrder[i] is the bank of the file placed in the bank 'i' of the chip
+static int bankOrder[MAX_BANKS];
+static int bankCount = 0;
 
 
 char debug = 0;
@@ -94,17 +301,62 @@ unsigned char srData1 = 0;
 unsigned char data = 0;
 unsigned int addr = 0;
 int totalRead = 0;
+uint32_t rwOffset = 0;   // start address of -r and -w
+uint32_t rwLength = 0;   // number of bytes to read or write, 0: not set
 uint16_t setupAddr = 0;
 uint16_t setupAddrBank = 0;
 uint16_t slowWrite = 0;
+char eraseSectors = 0;
+char useRle = 0;   // -rle: run-length encoded transfers (used anyway when the firmware reports them)
+char swapBytes = 0;
+char verifyWrite = 0;
+uint8_t script[CF840_SCRIPT_MAX]; // bytecode of the -script
+int scriptLen = 0;
+char resumeWrite = 0;  // continue the interrupted write from its journal
+int usbTimeout = 0;  // timeout of the USB transfers in ms, 0: library default
+char gang = 0;
+char quiet = 0;  // no progress output (gang mode)
+char devSelect[64];
+char useDaemon = 1;  // submit the job to the daemon when it is running
+char sockName[256];
+int waitTime = 0;  // seconds to wait for the programmer to be connected
+int batchStep = 0; // later steps of a session keep the session options
+char moduleLabel[32];  // flash module in the timing database
+char copySrc[64];  // programmers of -copy: port path or serial number
+char copyDst[64];
+
+// Set while the daemon runs a job: fatal errors end the job, not the daemon.
+// fatal() is used only while parsing the job and selecting the programmers,
+// before any file, thread or device is in use: the job code returns errors.
+static volatile char jobActive = 0;
+static pthread_t jobThread;
+static atomic_int jobFailed;
+static jmp_buf jobExit;
+
+// exits the program or (in the daemon) the current job
+static void terminate(int code) {
+    if (jobActive && pthread_equal(pthread_self(), jobThread)) {
+        longjmp(jobExit, code);
+    }
+    if (jobActive) {
+        // a worker can't unwind the job: it ends, the job fails when it is joined
+        atomic_store(&jobFailed, code);
+        pthread_exit(NULL);
+    }
+    exit(code);
+}
 
 static void infoAndFatal(const int s, char *f, ...) {
     va_list ap;
     va_start(ap,f);
-    fprintf(stderr, "prog_pc: %s: ", strings[s]);
+    if (devLabel) {
+        fprintf(stderr, "prog_pc: [%s] %s: ", devLabel, strings[s]);
+    } else {
+        fprintf(stderr, "prog_pc: %s: ", strings[s]);
+    }
     vfprintf(stderr, f, ap);
     va_end(ap);
-    if (s) exit(s);
+    if (s) terminate(s);
 }
 
 #define info(...)   infoAndFatal(0, __VA_ARGS__)
@@ -122,167 +374,610 @@ static void usage(void) {
     "  -v     : set verbose mode \n"
     "  -debug : print USB library debugging info \n"
     "  -boot  : reset the CH55x into bootloader mode \n"
-    "  -i     : identify chip: read vendor and chip ID\n"
+    "  -list  : list the connected programmers \n"
+    "  -dev D : use the programmer D: either its port path (as printed\n"
+    "           by -list) or its serial number\n"
+    "  -gang  : run the command (-w, -erase, -i, -test) on all connected\n"
+    "           programmers concurrently\n"
+    "  -daemon : keep the programmers open and run the jobs submitted\n"
+    "           by other prog_pc invocations (see -sock)\n"
+    "  -sock S : socket of the daemon. Default: $PROG_PC_SOCKET,\n"
+    "           $XDG_RUNTIME_DIR/prog_pc.sock or /tmp/prog_pc-UID/daemon.sock\n"
+    "  -local : do not submit the job to the daemon\n"
+    "  -wait S : wait up to S seconds for the programmer to be connected\n"
+    "  +      : separates the steps of a session: all steps run on the same\n"
+    "           programmers, the options -v -dev -gang -wait apply to all\n"
+    "  -batch F : runs the steps from file F, one step per line\n"
+    "  -label L : label of the flash module: the erase and program\n"
+    "           durations are recorded per module and chip ID in\n"
+    "           ~/.prog_pc_timing (applies to the whole session)\n"
+    "  -timings : print the recorded durations and flag the modules\n"
+    "           getting slow\n"
+    "  -i     : identify chip: read vendor and chip ID and (with the\n"
+    "           current firmware) the protected sectors\n"
     "  -r  X  : read X number of 64 byte sectors\n"
+    "           X can be omitted when -len is used.\n"
+    "  -ofs A : optional parameter used along with -r and -w\n"
+    "           Reads or writes starting at the address A.\n"
+    "  -len N : optional parameter used along with -r and -w\n"
+    "           Reads or writes N bytes.\n"
+    "  -o  F  : optional parameter used along with -r\n"
+    "           Writes the read data to file F instead of the standard output.\n"
+    "  -o2 F  : optional parameter used along with -r and -o\n"
+    "           Splits the read data: even bytes are written to the file\n"
+    "           set by -o, odd bytes to the file F.\n"
     "  -w  F  : write a file F to flash. The chip must be erased\n"
-    "           before writing.\n"
+    "           before writing. Use - as F to read from the standard input.\n"
+    "           Intel HEX (.hex, .ihx) and S-record (.srec, .s19, .s28,\n"
+    "           .s37, .mot) files are written sparsely: only the bytes\n"
+    "           present in the file are programmed.\n"
+    "  -diff F : compare the chip with the file F and print the exact\n"
+    "           differing ranges. Only the ranges whose checksums differ\n"
+    "           are read. Binary files are compared at -ofs (up to -len\n"
+    "           bytes), HEX and S-record files at their addresses.\n"
+    "  -copy S D : copy the chip of the programmer S to the chip of the\n"
+    "           programmer D (port paths or serial numbers, see -list).\n"
+    "           Both run at the same time, the chips are compared by their\n"
+    "           checksums at the end. Uses -ofs, -len, -esec, -slow, -rle.\n"
+    "  -test  : self-test of the programmer and the module: prints the\n"
+    "           stuck and shorted data lines, the suspect address lines,\n"
+    "           READY and whether the chip accepts the commands (WE#, CE#)\n"
     "  -erase : erase the whole chip\n"
     "  -vsp A : verify sector protect at adddress A\n"
     "  -ers A : erase sector at address A (see IC datasheet)\n"
+    "  -w2 F  : optional parameter used along with -w\n"
+    "           Interleaves the files: the file set by -w provides even bytes,\n"
+    "           the file F odd bytes.\n"
+    "  -swap  : optional parameter used along with -r and -w\n"
+    "           Swaps the bytes of each 16 bit word. Binary data must\n"
+    "           have an even number of bytes.\n"
+    "  -banks L : optional parameter used along with -r and -w\n"
+    "           Reorders equally sized banks of the data. L is a comma\n"
+    "           separated list: L[i] is the bank of the file stored in\n"
+    "           the bank i of the chip. Example: -banks 1,0\n"
+    "  -verify : optional parameter used along with -w\n"
+    "           Reads back and compares each block right after writing it.\n"
+    "  -resume : optional parameter used along with -w\n"
+    "           Continues an interrupted write of the same file after\n"
+    "           the last completed block, without erasing the chip again.\n"
+    "  -esec  : optional parameter used along with -w\n"
+    "           Erases only the sectors touched by the written data before\n"
+    "           writing them.\n"
+    "  -rle   : optional parameter used along with -r and -w\n"
+    "           Transfers the data run-length encoded: faster for images\n"
+    "           with large fill areas. Used automatically when the firmware\n"
+    "           reports the support, older firmware uses plain transfers.\n"
     "  -slow  : optional parameter used along with -w\n"
     "           It will ignore READY signal from the Flash chip\n"
     "           during write operation. READY pin can be disconnected.\n"
+    "  -timeout MS : timeout of the USB transfers in milliseconds\n"
+    "           (default 50). Failed transfers are repeated.\n"
     "\n"
     "commands for testing / troubleshooting of the board and modules\n"
     "  -c X   : send a byte to a control register\n"
     "  -dr    : read data byte and status\n"
     "  -dw X  : write data byte\n"
     "  -a  X  : set 20 bit address \n"
+    "  -script S : run the bus script S on the programmer and print the read\n"
+    "           bytes. Statements separated by ';': addr A, write [A] D,\n"
+    "           read [A], inc, rdy MS, poll D MS, loop N ... next, delay US\n"
     "\n"
     "Examples:\n"
     "   prog_pc -i \n"
+    "   prog_pc -test \n"
     "   prog_pc -erase \n"
     "   prog_pc -w rom.bin \n"
+    "   cat rom.bin | prog_pc -w - \n"
     "   prog_pc -r 16384 > flash_data.bin \n"
+    "   prog_pc -r 16384 -o flash_data.bin \n"
     "   prog_pc -w rom.bin -slow\n"
+    "   prog_pc -gang -w rom.bin -verify\n"
+    "   prog_pc -w firmware.hex -esec\n"
+    "   prog_pc -w even.bin -w2 odd.bin -swap\n"
+    "   prog_pc -r 16384 -o even.bin -o2 odd.bin\n"
+    "   prog_pc -r -ofs 0x80000 -len 0x80000 -o bank1.bin\n"
+    "   prog_pc -w table.bin -ofs 0x1F000\n"
+    "   prog_pc -w rom.bin -esec -resume\n"
+    "   prog_pc -copy 1-2.1 1-2.2 -esec\n"
+    "   prog_pc -daemon &\n"
+    "   prog_pc -i + -erase + -w rom.bin -verify + -r 16384 -o check.bin\n"
+    "   prog_pc -script \"write 0xAAA 0xAA; write 0x1555 0x55; write 0x2AAA 0x90; read 0x100; write 0 0xF0\"\n"
     );
-    exit(1);
+    terminate(1);
+
+}
+
+// prints the diagnostic messages of the library in verbose mode
+static void logLibrary(void* user, const char* msg)
+{
+    info("%s", msg);
+}
 
+static void initProgrammer(Programmer* p, Cf840Device* dev)
+{
+    memset(p, 0, sizeof(Programmer));
+    p->dev = dev;
+    p->path = cf840Path(dev);
+    p->serial = cf840Serial(dev);
 }
 
-static int dumpBuffer(uint8_t* buf, int size) {
+/**
+ * Opens all the programmers, returns the number of devices found.
+ * When 'paths' is set, only the devices at these port paths are checked.
+ */
+static int findProgrammers(Cf840Context* c, Programmer* list, const char* paths) {
+    Cf840Device* devs[MAX_DEVICES];
+    int cnt = cf840OpenAll(c, paths, devs, MAX_DEVICES);
     int i;
-    for (i = 0; i < size; i++) {
-        printf("%02X ", buf[i]);
-        if (i % 16 == 15) {
-            printf("\n");
-        }
+
+    for (i = 0; i < cnt; i++) {
+        initProgrammer(&list[i], devs[i]);
     }
-    printf("\n");
-    return 0;
-} 
+    return cnt;
+}
 
-static int sendControlTransfer(libusb_device_handle *h, uint8_t command, uint16_t param1, uint16_t param2, uint8_t len) {
-    int ret;
+static void closeProgrammer(Programmer* p)
+{
+    cf840Close(p->dev);
+    p->dev = NULL;
+}
 
-    ret = libusb_control_transfer(h, TYPE_OUT_ITF, command, param1, param2, outBuf, len, 50);
-    if (verbose) {
-        info("control transfer out:  result=%i \n", ret);
+// checks whether the programmer matches the -dev parameter
+// checks the port path or the serial number of the programmer
+static int programmerMatches(Programmer* p, const char* name)
+{
+    return strcmp(name, p->path) == 0 || strcasecmp(name, p->serial) == 0;
+}
+
+static int programmerSelected(Programmer* p)
+{
+    return devSelect[0] == 0 || programmerMatches(p, devSelect);
+}
+
+// name of the file with the port paths of the programmers found last time
+static void getCacheName(char* name, int size)
+{
+    const char* home = getenv("HOME");
+    snprintf(name, size, "%s/.prog_pc_dev", home ? home : ".");
+}
+
+// name of the journal of the writes done by the programmer
+static void getJournalName(Cf840Device* dev, char* name, int size)
+{
+    const char* home = getenv("HOME");
+    const char* serial = cf840Serial(dev);
+    snprintf(name, size, "%s/.prog_pc_journal-%s", home ? home : ".", strcmp(serial, "-") ? serial : cf840Path(dev));
+}
+
+static int loadDevCache(char* paths, int size)
+{
+    char name[1024];
+    FILE* f;
+    int len;
+
+    getCacheName(name, sizeof(name));
+    f = fopen(name, "r");
+    if (f == NULL) {
+        return -1;
     }
-    return ret;
+    len = fread(paths, 1, size - 1, f);
+    fclose(f);
+    paths[len > 0 ? len : 0] = 0;
+    return len > 0 ? 0 : -1;
 }
 
-static int recvControlTransfer(libusb_device_handle *h, uint8_t command, uint16_t param1, uint16_t param2) {
-    int ret;
-    memset(resBuf, 0, sizeof(resBuf));
+static void saveDevCache(Programmer* list, int cnt)
+{
+    char name[1024];
+    FILE* f;
+    int i;
+
+    getCacheName(name, sizeof(name));
+    f = fopen(name, "w");
+    if (f == NULL) {
+        return;
+    }
+    for (i = 0; i < cnt; i++) {
+        fprintf(f, "%s\n", list[i].path);
+    }
+    fclose(f);
+}
+
+/**
+ * Keeps the opened programmers selected by -dev.
+ * Returns the number of programmers ready to use.
+ */
+static int prepareProgrammers(Programmer* list, int cnt)
+{
+    int i, used = 0;
 
-    ret = libusb_control_transfer(h, TYPE_IN_ITF, command, param1, param2, resBuf, sizeof(resBuf), 50);
+    for (i = 0; i < cnt; i++) {
+        if (!programmerSelected(&list[i])) {
+            closeProgrammer(&list[i]);
+            continue;
+        }
+        list[used++] = list[i];
+    }
     if (verbose) {
-        info("control transfer (0x%02x) incoming:  result=%i\n", command, ret);
-        dumpBuffer(resBuf, sizeof(resBuf));
+        info("programmers ready: %i\n", used);
     }
-    return ret;
+    return used;
 }
 
-//try to find the programmer usb device
-static libusb_device_handle* getDeviceHandle(libusb_context* c) {
-    int max;
-    int ret;
-    int device_index = -1;
+/**
+ * Finds and sets up all programmers (or the one selected by -dev).
+ * A single programmer is first looked for at the port paths cached by
+ * the last full scan, so other devices sharing the USB IDs are not opened.
+ * Returns the number of programmers ready to use.
+ */
+static int openProgrammers(Cf840Context* c, Programmer* list)
+{
+    char paths[1024];
+    int cnt;
+
+    // the port path (always contains '-') is known without opening the other devices
+    if (strchr(devSelect, '-')) {
+        return prepareProgrammers(list, findProgrammers(c, list, devSelect));
+    }
+    if (!gang && action != ACTION_LIST_DEVICES && action != ACTION_DAEMON && action != ACTION_COPY &&
+        loadDevCache(paths, sizeof(paths)) == 0
+    ) {
+        cnt = prepareProgrammers(list, findProgrammers(c, list, paths));
+        if (cnt > 0) {
+            return cnt;
+        }
+        if (verbose) {
+            info("no programmer at the cached port paths\n");
+        }
+    }
+    cnt = findProgrammers(c, list, NULL);
+    saveDevCache(list, cnt);
+    return prepareProgrammers(list, cnt);
+}
+
+// hotplug events passed from the event thread to the main thread
+static pthread_mutex_t hotplugLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplugCond = PTHREAD_COND_INITIALIZER;
+static libusb_device* hotplugArrived[MAX_DEVICES];
+static libusb_device* hotplugLeft[MAX_DEVICES];
+static int hotplugArrivedCnt = 0;
+static int hotplugLeftCnt = 0;
+static volatile char hotplugActive = 0;
+static libusb_hotplug_callback_handle hotplugHandle;
+static pthread_t hotplugThread;
+static Cf840Context* hotplugCtx;
+
+static int LIBUSB_CALL hotplugCallback(libusb_context* c, libusb_device* dev, libusb_hotplug_event event, void* user)
+{
+    pthread_mutex_lock(&hotplugLock);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        if (hotplugArrivedCnt < MAX_DEVICES) {
+            hotplugArrived[hotplugArrivedCnt++] = libusb_ref_device(dev);
+        }
+    } else {
+        if (hotplugLeftCnt < MAX_DEVICES) {
+            hotplugLeft[hotplugLeftCnt++] = libusb_ref_device(dev);
+        }
+    }
+    pthread_cond_broadcast(&hotplugCond);
+    pthread_mutex_unlock(&hotplugLock);
+    return 0;
+}
+
+// handles the libusb events: the hotplug callbacks are called from here
+static void* hotplugWorker(void* arg)
+{
+    libusb_context* c = (libusb_context*) arg;
+    while (hotplugActive) {
+        struct timeval tv = { 0, 200 * 1000 };
+        libusb_handle_events_timeout_completed(c, &tv, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Starts watching the programmers being connected and disconnected.
+ * Returns 0 when hotplug is supported.
+ */
+static int hotplugStart(Cf840Context* ctx)
+{
+    libusb_context* c = cf840UsbContext(ctx);
+
+    hotplugCtx = ctx;
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return -1;
+    }
+    if (libusb_hotplug_register_callback(c,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_NO_FLAGS, VENDOR_ID, PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+        hotplugCallback, NULL, &hotplugHandle) != LIBUSB_SUCCESS
+    ) {
+        return -1;
+    }
+    hotplugActive = 1;
+    if (pthread_create(&hotplugThread, NULL, hotplugWorker, c)) {
+        hotplugActive = 0;
+        libusb_hotplug_deregister_callback(c, hotplugHandle);
+        return -1;
+    }
+    return 0;
+}
+
+// stops watching and releases the devices of the events not applied yet
+static void hotplugStop(Cf840Context* ctx)
+{
     int i;
-    libusb_device** dev_list = NULL;
-    struct libusb_device_descriptor des;
-    struct libusb_device_handle* handle;
 
-    ret = libusb_get_device_list(c, &dev_list);
-    if (verbose) {
-        info("total USB devices found: %i \n", ret);
+    if (hotplugActive) {
+        hotplugActive = 0;
+        libusb_hotplug_deregister_callback(cf840UsbContext(ctx), hotplugHandle);
+        pthread_join(hotplugThread, NULL);
+    }
+    pthread_mutex_lock(&hotplugLock);
+    for (i = 0; i < hotplugArrivedCnt; i++) {
+        libusb_unref_device(hotplugArrived[i]);
     }
-    max = ret;
-    //print all devices
-    for (i = 0; i < max; i++) {
-        char vendorName[32];
-        char productName[32];
-        ret = libusb_get_device_descriptor(dev_list[i],  & des);
-        if (des.idVendor == VENDOR_ID && des.idProduct == PRODUCT_ID) {
+    for (i = 0; i < hotplugLeftCnt; i++) {
+        libusb_unref_device(hotplugLeft[i]);
+    }
+    hotplugArrivedCnt = 0;
+    hotplugLeftCnt = 0;
+    pthread_mutex_unlock(&hotplugLock);
+}
 
-            //get the device handle in order to get the vendor name and product name
-            ret = libusb_open(dev_list[i], &handle);
-            if (verbose) {
-                info("open device result=%i\n", ret);
+/**
+ * Applies the pending hotplug events to the list of the programmers.
+ * Returns the new number of programmers.
+ */
+static int hotplugUpdate(Programmer* list, int cnt)
+{
+    libusb_device* arrived[MAX_DEVICES];
+    libusb_device* left[MAX_DEVICES];
+    Cf840Device* dev;
+    int arrivedCnt, leftCnt;
+    int i, j;
+
+    pthread_mutex_lock(&hotplugLock);
+    arrivedCnt = hotplugArrivedCnt;
+    leftCnt = hotplugLeftCnt;
+    memcpy(arrived, hotplugArrived, sizeof(arrived));
+    memcpy(left, hotplugLeft, sizeof(left));
+    hotplugArrivedCnt = 0;
+    hotplugLeftCnt = 0;
+    pthread_mutex_unlock(&hotplugLock);
+
+    for (i = 0; i < leftCnt; i++) {
+        for (j = 0; j < cnt; j++) {
+            if (cf840UsbDevice(list[j].dev) == left[i]) {
+                info("programmer %s disconnected\n", list[j].path);
+                closeProgrammer(&list[j]);
+                memmove(&list[j], &list[j + 1], (cnt - j - 1) * sizeof(Programmer));
+                cnt--;
+                break;
+            }
+        }
+        libusb_unref_device(left[i]);
+    }
+    for (i = 0; i < arrivedCnt; i++) {
+        // the device may have been found by the scan already
+        for (j = 0; j < cnt; j++) {
+            if (cf840UsbDevice(list[j].dev) == arrived[i]) {
+                break;
             }
-            if (ret) {
-                libusb_free_device_list(dev_list, 1);
-                fatal("device open failed\n");
+        }
+        if (j == cnt && cnt < MAX_DEVICES) {
+            int ret = cf840OpenUsb(hotplugCtx, arrived[i], &dev);
+            if (ret == CF840_OK) {
+                initProgrammer(&list[cnt], dev);
+                info("programmer %s connected\n", list[cnt].path);
+                cnt++;
+            } else
+            if (ret != CF840_ERROR_NOT_FOUND) {
+                info("new device can't be used: %s\n", cf840ErrorName(ret));
             }
+        }
+        libusb_unref_device(arrived[i]);
+    }
+    return cnt;
+}
 
-            //retrieve the texts
-            vendorName[0] = 0;
-            libusb_get_string_descriptor_ascii(handle, des.iManufacturer, vendorName, sizeof(vendorName));
-            vendorName[sizeof(vendorName) - 1] = 0;
-            productName[0] = 0;
-            libusb_get_string_descriptor_ascii(handle, des.iProduct, productName, sizeof(productName));
-            productName[sizeof(productName) - 1] = 0;
+/**
+ * Waits up to -wait seconds until a programmer selected by -dev is connected.
+ * Without hotplug support the bus is scanned periodically.
+ * Returns the new number of programmers.
+ */
+static int waitForProgrammers(Cf840Context* c, Programmer* list, int cnt)
+{
+    struct timeval now;
+    struct timespec deadline;
+    int i;
 
-            libusb_close(handle);
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + waitTime;
+    deadline.tv_nsec = now.tv_usec * 1000;
 
-            if (verbose) {
-                info("device %i  vendor=%04x, product=%04x bus:device=%i:%i %s/%s\n",
-                        i, des.idVendor, des.idProduct,
-                        libusb_get_bus_number(dev_list[i]),
-                        libusb_get_device_address(dev_list[i]),
-                        vendorName, productName
-                );
+    while (1) {
+        for (i = 0; i < cnt; i++) {
+            if (programmerSelected(&list[i])) {
+                return cnt;
+            }
+        }
+        gettimeofday(&now, NULL);
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_usec * 1000 >= deadline.tv_nsec)) {
+            return cnt;
+        }
+        if (hotplugActive) {
+            pthread_mutex_lock(&hotplugLock);
+            if (hotplugArrivedCnt == 0 && hotplugLeftCnt == 0) {
+                pthread_cond_timedwait(&hotplugCond, &hotplugLock, &deadline);
             }
-            
-            //ensure the vendor name and product name matches
-            if (
-                device_index == -1 &&
-                strcmp(VENDOR_NAME, vendorName) == 0 &&
-                strcmp(PRODUCT_NAME, productName) == 0
-            ) {
-                device_index = i;
+            pthread_mutex_unlock(&hotplugLock);
+            cnt = hotplugUpdate(list, cnt);
+        } else {
+            usleep(100 * 1000);
+            for (i = 0; i < cnt; i++) {
+                closeProgrammer(&list[i]);
             }
+            cnt = prepareProgrammers(list, findProgrammers(c, list, NULL));
         }
     }
+}
 
-    if (device_index < 0) {
-        libusb_free_device_list(dev_list, 1);
-        fatal("no device found\n");
-    }
+// parses a comma separated permutation of banks: for example 2,3,0,1
+static void parseBankOrder(char* list) {
+    int used = 0;
+    char* end;
 
-    if (verbose) {
-        info("using device: %i \n", device_index);
+    bankCount = 0;
+    while (*list) {
+        int b = (int) strtol(list, &end, 0);
+        if (end == list || bankCount == MAX_BANKS || b < 0 || b >= MAX_BANKS || (used & (1 << b))) {
+            fatal("-banks: invalid bank list\n");
+        }
+        used |= 1 << b;
+        bankOrder[bankCount++] = b;
+        list = (*end == ',') ? end + 1 : end;
     }
+    // all banks must be used exactly once
+    if (used != (1 << bankCount) - 1) {
+        fatal("-banks: invalid bank list\n");
+    }
+}
 
-    ret = libusb_open(dev_list[device_index], &handle);
-    if (verbose) {
-        info("open device result=%i\n", ret);
+// appends an opcode with its operands to the script
+static void emitScript(int op, int cnt, const uint32_t* args) {
+    int i;
+
+    if (scriptLen + 1 + cnt > CF840_SCRIPT_MAX) {
+        fatal("-script: the script is longer than %i bytes\n", CF840_SCRIPT_MAX);
     }
-    if (ret) {
-        libusb_free_device_list(dev_list, 1);
-        fatal("device open failed\n");
+    script[scriptLen++] = op;
+    for (i = 0; i < cnt; i++) {
+        script[scriptLen++] = args[i] & 0xFF;
     }
+}
 
-    libusb_free_device_list(dev_list, 1);
+// emits the ops setting the address: addresses in bank 0 are set by the
+// write itself (WRITE16) when 'write' is set
+static void emitScriptAddr(uint32_t a, int write, uint32_t d) {
+    uint32_t args[3] = { (a >> 16) & 0xF, (a >> 8) & 0xFF, a & 0xFF };
 
-    //get config
-    ret = libusb_get_descriptor(handle, LIBUSB_DT_DEVICE, 0, descriptor, 18);
-    if (verbose) {
-        info("get device descriptor 0 result=%i\n", ret);
+    if (write && a <= 0xFFFF) {
+        args[0] = args[1];
+        args[1] = args[2];
+        args[2] = d;
+        emitScript(CF840_SCRIPT_WRITE16, 3, args);
+        return;
     }
-    ret = libusb_get_descriptor(handle, LIBUSB_DT_CONFIG, 0, descriptor, 255);
-    if (verbose) {
-        info("get device configuration 0 result=%i\n", ret);
+    emitScript(CF840_SCRIPT_ADDR, 3, args);
+    if (write) {
+        emitScript(CF840_SCRIPT_WRITE, 1, &d);
     }
-    usleep(20*1000);
-
-    return handle;
 }
 
+/**
+ * Assembles the -script text to the bytecode run by the firmware.
+ * Statements are separated by ';' or new lines, the numbers are decimal
+ * or hex (0x prefix):
+ *   addr A, write [A] D, read [A], inc, rdy MS, poll D MS,
+ *   loop N ... next, delay US
+ */
+static void parseScript(const char* text) {
+    static const struct {
+        const char* name;
+        int op;
+        int minArgs;
+        int maxArgs;
+    } ops[] = {
+        { "addr", CF840_SCRIPT_ADDR, 1, 1 },
+        { "write", CF840_SCRIPT_WRITE, 1, 2 },
+        { "read", CF840_SCRIPT_READ, 0, 1 },
+        { "inc", CF840_SCRIPT_INC, 0, 0 },
+        { "rdy", CF840_SCRIPT_WAIT_RDY, 1, 1 },
+        { "poll", CF840_SCRIPT_POLL, 2, 2 },
+        { "loop", CF840_SCRIPT_LOOP, 1, 1 },
+        { "next", CF840_SCRIPT_NEXT, 0, 0 },
+        { "delay", CF840_SCRIPT_DELAY, 1, 1 },
+        { NULL, 0, 0, 0 }
+    };
+    char buf[1024];
+    char* stmt;
+    char* save = NULL;
+    int loops = 0;
+
+    scriptLen = 0;
+    strncpy(buf, text, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    for (stmt = strtok_r(buf, ";\n", &save); stmt != NULL; stmt = strtok_r(NULL, ";\n", &save)) {
+        char* words[3];
+        char* word;
+        char* wsave = NULL;
+        uint32_t args[3];
+        int cnt = 0;
+        int i, j;
+
+        for (word = strtok_r(stmt, " \t", &wsave); word != NULL; word = strtok_r(NULL, " \t", &wsave)) {
+            if (cnt == 3) {
+                fatal("-script: too many numbers: %s\n", words[0]);
+            }
+            words[cnt++] = word;
+        }
+        if (cnt == 0) {
+            continue;
+        }
+        for (i = 0; ops[i].name != NULL && strcmp(ops[i].name, words[0]) != 0; i++);
+        if (ops[i].name == NULL || cnt - 1 < ops[i].minArgs || cnt - 1 > ops[i].maxArgs) {
+            fatal("-script: invalid statement: %s\n", words[0]);
+        }
+        for (j = 1; j < cnt; j++) {
+            char* end;
+            args[j - 1] = (uint32_t) strtoul(words[j], &end, 0);
+            if (*end != 0) {
+                fatal("-script: invalid number: %s\n", words[j]);
+            }
+        }
+        switch (ops[i].op) {
+            case CF840_SCRIPT_ADDR:
+                emitScriptAddr(args[0], 0, 0);
+                break;
+            case CF840_SCRIPT_WRITE:
+                if (cnt == 3) {
+                    emitScriptAddr(args[0], 1, args[1]);
+                } else {
+                    emitScript(CF840_SCRIPT_WRITE, 1, args);
+                }
+                break;
+            case CF840_SCRIPT_READ:
+                if (cnt == 2) {
+                    emitScriptAddr(args[0], 0, 0);
+                }
+                emitScript(CF840_SCRIPT_READ, 0, args);
+                break;
+            case CF840_SCRIPT_LOOP:
+                loops++;
+                emitScript(ops[i].op, 1, args);
+                break;
+            case CF840_SCRIPT_NEXT:
+                loops--;
+                emitScript(ops[i].op, 0, args);
+                break;
+            default:
+                emitScript(ops[i].op, cnt - 1, args);
+                break;
+        }
+        // the firmware supports one loop level
+        if (loops < 0 || loops > 1) {
+            fatal("-script: loops can't be nested, each loop needs its next\n");
+        }
+    }
+    if (scriptLen == 0 || loops) {
+        fatal("-script: %s\n", scriptLen ? "missing next" : "empty script");
+    }
+}
 
 static void checkArgumentValue(int i, int argc, char** argv, char* fatalText) {
-    if (i >= argc || argv[i][0] == '-') {
+    // a single dash is a valid value: standard input
+    if (i >= argc || (argv[i][0] == '-' && argv[i][1] != 0)) {
         fatal(fatalText);
     }
 }
@@ -291,8 +986,43 @@ static void checkArguments(int argc, char** argv) {
     int i;
     char* arg;
 
+    // the daemon parses the arguments of every job: reset all of them
     action = 0;
+    srData1 = 0;
+    data = 0;
+    addr = 0;
+    totalRead = 0;
+    rwOffset = 0;
+    rwLength = 0;
+    setupAddr = 0;
+    setupAddrBank = 0;
+    slowWrite = 0;
+    eraseSectors = 0;
+    useRle = 0;
+    swapBytes = 0;
+    verifyWrite = 0;
+    resumeWrite = 0;
+    usbTimeout = 0;
+    scriptLen = 0;
+    bankCount = 0;
     fname[0] = 0;
+    fname2[0] = 0;
+    oname[0] = 0;
+    oname2[0] = 0;
+    copySrc[0] = 0;
+    copyDst[0] = 0;
+    // options of the whole session
+    if (batchStep == 0) {
+        verbose = 0;
+        debug = 0;
+        gang = 0;
+        quiet = 0;
+        useDaemon = 1;
+        devSelect[0] = 0;
+        strcpy(moduleLabel, "-");
+        sockName[0] = 0;
+        waitTime = 0;
+    }
 
     if (argc <= 1) {
         return;
@@ -355,15 +1085,63 @@ static void checkArguments(int argc, char** argv) {
             if (strcmp("-dr", arg) == 0) {
                 action = COMMAND_GET_DATA;
             } else
+            if (strcmp("-script", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-script: missing script\n");
+                action = COMMAND_SCRIPT;
+                parseScript(argv[++i]);
+            } else
             if (strcmp("-w", arg) == 0) {
                 checkArgumentValue(i + 1, argc, argv, "-w: missing file name\n");
                 action = COMMAND_WRITE;
                 strcpy(fname, argv[++i]);
             } else
+            if (strcmp("-diff", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-diff: missing file name\n");
+                action = ACTION_DIFF;
+                strcpy(fname, argv[++i]);
+            } else
+            if (strcmp("-copy", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-copy: missing source and destination programmer\n");
+                checkArgumentValue(i + 2, argc, argv, "-copy: missing source and destination programmer\n");
+                action = ACTION_COPY;
+                strncpy(copySrc, argv[++i], sizeof(copySrc) - 1);
+                strncpy(copyDst, argv[++i], sizeof(copyDst) - 1);
+            } else
             if (strcmp("-r", arg) == 0) {
-                checkArgumentValue(i + 1, argc, argv, "-r: missing number of sectors parameter\n");
                 action = COMMAND_READ;
-                totalRead = (int) strtol(argv[++i], NULL, 0);
+                // the number of sectors is optional when -len is used
+                if (i + 1 < argc && argv[i + 1][0] != '-') {
+                    totalRead = (int) strtol(argv[++i], NULL, 0);
+                } else {
+                    totalRead = -1;
+                }
+            } else
+            if (strcmp("-ofs", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-ofs: missing address\n");
+                rwOffset = (uint32_t) (strtol(argv[++i], NULL, 0) & 0xFFFFF);
+            } else
+            if (strcmp("-len", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-len: missing number of bytes\n");
+                rwLength = (uint32_t) strtol(argv[++i], NULL, 0);
+            } else
+            if (strcmp("-o", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-o: missing file name\n");
+                strcpy(oname, argv[++i]);
+            } else
+            if (strcmp("-o2", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-o2: missing file name\n");
+                strcpy(oname2, argv[++i]);
+            } else
+            if (strcmp("-w2", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-w2: missing file name\n");
+                strcpy(fname2, argv[++i]);
+            } else
+            if (strcmp("-swap", arg) == 0) {
+                swapBytes = 1;
+            } else
+            if (strcmp("-banks", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-banks: missing bank list\n");
+                parseBankOrder(argv[++i]);
             } else
             if (strcmp("-i", arg) == 0) {
                 action = COMMAND_SETUP;
@@ -371,6 +1149,63 @@ static void checkArguments(int argc, char** argv) {
             } else
             if (strcmp("-slow", arg) == 0) {
                 slowWrite = 0x100;
+            } else
+            if (strcmp("-esec", arg) == 0) {
+                eraseSectors = 1;
+            } else
+            if (strcmp("-rle", arg) == 0) {
+                useRle = 1;
+            } else
+            if (strcmp("-verify", arg) == 0) {
+                verifyWrite = 1;
+            } else
+            if (strcmp("-resume", arg) == 0) {
+                resumeWrite = 1;
+            } else
+            if (strcmp("-timeout", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-timeout: missing number of milliseconds\n");
+                usbTimeout = atoi(argv[++i]);
+            } else
+            if (strcmp("-gang", arg) == 0) {
+                gang = 1;
+                quiet = 1;
+            } else
+            if (strcmp("-list", arg) == 0) {
+                action = ACTION_LIST_DEVICES;
+            } else
+            if (strcmp("-daemon", arg) == 0) {
+                action = ACTION_DAEMON;
+            } else
+            if (strcmp("-wait", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-wait: missing number of seconds\n");
+                waitTime = atoi(argv[++i]);
+            } else
+            if (strcmp("-local", arg) == 0) {
+                useDaemon = 0;
+            } else
+            if (strcmp("-sock", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-sock: missing socket name\n");
+                if (strlen(argv[++i]) >= sizeof(sockName)) {
+                    fatal("-sock: up to %i characters\n", (int) sizeof(sockName) - 1);
+                }
+                strcpy(sockName, argv[i]);
+            } else
+            if (strcmp("-dev", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-dev: missing device path or serial number\n");
+                strncpy(devSelect, argv[++i], sizeof(devSelect) - 1);
+            } else
+            if (strcmp("-label", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-label: missing module label\n");
+                if (strlen(argv[++i]) >= sizeof(moduleLabel) || strpbrk(argv[i], " \t\n")) {
+                    fatal("-label: up to %i characters without spaces\n", (int) sizeof(moduleLabel) - 1);
+                }
+                strcpy(moduleLabel, argv[i]);
+            } else
+            if (strcmp("-timings", arg) == 0) {
+                action = ACTION_TIMINGS;
+            } else
+            if (strcmp("-test", arg) == 0) {
+                action = ACTION_SELF_TEST;
             }
 
             else {
@@ -380,371 +1215,3016 @@ static void checkArguments(int argc, char** argv) {
             fatal("unknown parameter: %s\n" , arg);
         }
     }
+    if (action == COMMAND_READ && totalRead < 0 && rwLength == 0) {
+        fatal("-r: missing number of sectors parameter\n");
+    }
+    if (gang && action != COMMAND_WRITE && action != COMMAND_SETUP && action != ACTION_SELF_TEST && action != 0 && action != ACTION_LIST_DEVICES) {
+        fatal("-gang: only -w, -erase, -i and -test are supported\n");
+    }
+    if (action == ACTION_COPY && devSelect[0]) {
+        fatal("-copy: the programmers are selected by -copy, not by -dev\n");
+    }
+    if (gang && action == COMMAND_WRITE && (strcmp("-", fname) == 0 || strcmp("-", fname2) == 0)) {
+        fatal("-gang: the standard input can't be written to multiple programmers\n");
+    }
 }
 
-static int flashIoFinished(libusb_device_handle* h)
+/**
+ * Retrieves data and status bytes from the flash IC.
+ */
+static int commandGetData(Cf840Device* dev)
 {
-    int ret = recvControlTransfer(h, COMMAND_GET_DATA, 0, 0);
+    uint8_t buf[2];
+    int ret = cf840Request(dev, COMMAND_GET_DATA, 0, 0, buf, 2);
     if (ret != 2) {
-        info("Get data/status failed. result=%i\n", ret); 
+        info("Get data failed. result=%i\n", ret); 
+        return -1;
     }
-    //printf("buf 1 = 0x%02x\n", resBuf[1]);
+    info("Data read: 0x%02x  status: 0x%02x\n", buf[0], buf[1]);
+    return 0;
+}
+
+/**
+ * Runs the -script and prints the bytes it read
+ */
+static int runScript(Cf840Device* dev)
+{
+    uint8_t buf[CF840_SCRIPT_MAX];
+    int ret = cf840Script(dev, script, scriptLen, buf, sizeof(buf));
+    int i;
 
-    return resBuf[1]; 
+    if (ret < 0) {
+        info("Script failed: %s\n", cf840ErrorName(ret));
+        return -1;
+    }
+    info("Script read %i bytes\n", ret);
+    for (i = 0; i < ret; i++) {
+        printf("%02x%c", buf[i], (i % 16 == 15 || i == ret - 1) ? '\n' : ' ');
+    }
+    return 0;
 }
 
-static int waitForFlashIoFinish(libusb_device_handle* h, int initialDelay, int step, int errorState)
+// prints the protected address ranges of the map read by cf840ProtectMap()
+static void printProtectMap(const uint8_t* protect)
 {
+    int cnt = 0;
+    int i, start;
 
-    usleep(initialDelay);
-    while (1){
-        int ret = flashIoFinished(h);
-        if (ret == 0) {
-            return 0;
+    for (i = 0; i < CF840_PROTECT_MAP_SIZE * 8; i++) {
+        if (!(protect[i >> 3] & (1 << (i & 7)))) {
+            continue;
         }
-        if (errorState != 0 && ret == errorState) {
-            return ret;
+        for (start = i; i + 1 < CF840_PROTECT_MAP_SIZE * 8 && (protect[(i + 1) >> 3] & (1 << ((i + 1) & 7))); i++) {
         }
-        usleep(step);
+        info("Protected: 0x%06x-0x%06x\n", start * 8192, (i + 1) * 8192 - 1);
+        cnt++;
+    }
+    if (cnt == 0) {
+        info("Protected: none\n");
     }
 }
 
 /**
- * Writes a file to the flash IC starting at address 0.
+ * Retrieves the vendor ID and product ID of the flash chip
  */
-static int writeFlash(libusb_device_handle* h)
+static int runIdentifyFlashChip(Cf840Device* dev)
 {
-    FILE* f;
-    int size = 1;
-    int result = 0;
-
-    uint32_t pos = 0;
-    uint16_t addr = 0;
-    uint16_t bank = 0;
-
-    uint16_t index = SETUP_WRITE << 8;
-
-    f = fopen(fname, "r");
-    if (f) {
-        // setup for Write -> set WE low
-        int ret = sendControlTransfer(h, COMMAND_SETUP, 0, index, 0);
-        if (verbose) {
-            info("Setup write cmd result=%i\n", ret);
-        }
-        usleep(500);
+    int ret;
+    uint8_t vendorId = 0;
+    uint8_t productId = 0;
+    uint8_t protect[CF840_PROTECT_MAP_SIZE];
+    const Cf840ChipInfo* chip;
+    int mapped;
 
-        while (size > 0) {
-            size = fread(outBuf, 1, sizeof(outBuf), f);
+    // the protection of all sectors is read with the IDs when the firmware can
+    ret = cf840ProtectMap(dev, &vendorId, &productId, protect);
+    mapped = (ret == CF840_OK);
+    if (ret == CF840_ERROR_UNSUPPORTED) {
+        ret = cf840Identify(dev, &vendorId, &productId);
+    }
+    if (ret) {
+        info("Identify failed: %s\n", cf840ErrorName(ret));
+        return ret;
+    }
+    chip = cf840FindChip(productId);
+    info("VendorId: 0x%02x  ProductId: 0x%02x %s\n", vendorId, productId, chip ? chip->name : "");
+    if (mapped) {
+        printProtectMap(protect);
+    }
+    if (current) {
+        current->chip = chip;
+        current->chipKnown = 1;
+        current->manufId = vendorId;
+        current->deviceId = productId;
+    }
+    return 0;
+}
+
+// prints the lines of the mask: data lines DQi on P1.i, address lines by the
+// bit of the byte address (A-1 in byte mode) with the 595 register driving them
+static void printLines(const char* what, uint32_t mask, int addrLines)
+{
+    static const char* const regs[3] = { "U1", "U2", "U3" };
+    char text[512];
+    int len = 0;
+    int i;
+
+    for (i = 0; i < 20 && len < (int) sizeof(text) - 32; i++) {
+        if (!(mask & (1u << i))) {
+            continue;
+        }
+        if (!addrLines) {
+            len += sprintf(text + len, " DQ%i(P1.%i)", i, i);
+        } else
+        if (i == 0) {
+            len += sprintf(text + len, " A-1(%s)", regs[0]);
+        } else {
+            len += sprintf(text + len, " A%i(%s)", i - 1, regs[i >> 3]);
+        }
+    }
+    text[len] = 0;
+    info("  %s:%s\n", what, text);
+}
+
+/**
+ * Runs the self-test of the board and the module in the firmware and
+ * prints the faulty lines. Returns 0 when no fault is found.
+ */
+static int runSelfTest(Cf840Device* dev)
+{
+    Cf840SelfTestResult r;
+    int faults = 0;
+    int ret;
+
+    ret = cf840SelfTest(dev, &r);
+    if (ret) {
+        info("Self-test failed: %s\n", cf840ErrorName(ret));
+        return 1;
+    }
+    if (r.dataStuckLow | r.dataStuckHigh | r.dataShort) {
+        info("Data bus:\n");
+        if (r.dataStuckLow) {
+            printLines("stuck low", r.dataStuckLow, 0);
+        }
+        if (r.dataStuckHigh) {
+            printLines("stuck high", r.dataStuckHigh, 0);
+        }
+        if (r.dataShort) {
+            printLines("shorted", r.dataShort, 0);
+        }
+        faults++;
+    } else {
+        info("Data bus: OK\n");
+    }
+    if (r.flags & CF840_TEST_RDY_LOW) {
+        info("READY: low while the chip is idle\n");
+        faults++;
+    } else {
+        info("READY: OK\n");
+    }
+    if (r.flags & CF840_TEST_NO_AUTOSELECT) {
+        info("WE#/CE#: the chip ignores the commands (WE#, CE#, A-1..A10 or no chip)\n");
+        info("Address bus: not tested\n");
+        faults++;
+    } else {
+        const Cf840ChipInfo* chip = cf840FindChip(r.deviceId);
+        info("WE#/CE#: OK, chip ID 0x%02x 0x%02x %s\n", r.manufId, r.deviceId, chip ? chip->name : "");
+        if (r.flags & CF840_TEST_ADDR_SKIPPED) {
+            info("Address bus: not tested (JEDEC command set)\n");
+        } else
+        if (r.addrSuspect) {
+            info("Address bus:\n");
+            printLines("suspect", r.addrSuspect, 1);
+            faults++;
+        } else {
+            info("Address bus: OK\n");
+        }
+    }
+    info("Self-test %s\n", faults ? "FAILED" : "passed");
+    return faults ? 1 : 0;
+}
+
+/**
+ * Identifies the flash chip in the socket.
+ * Returns NULL for unknown chips.
+ */
+static const Cf840ChipInfo* getChip(Cf840Device* dev)
+{
+    uint8_t vendorId = 0;
+    uint8_t productId = 0;
+    const Cf840ChipInfo* chip = NULL;
+
+    // identified by an earlier step of the session
+    if (current && current->chipKnown) {
+        return current->chip;
+    }
+    if (cf840Identify(dev, &vendorId, &productId) == CF840_OK) {
+        chip = cf840FindChip(productId);
+        if (current) {
+            current->chip = chip;
+            current->chipKnown = 1;
+            current->manufId = vendorId;
+            current->deviceId = productId;
+        }
+    }
+    if (chip == NULL) {
+        info("unknown chip ID 0x%02x, assuming %i kbytes\n", productId, MAX_CHIP_SIZE / 1024);
+    } else
+    if (verbose) {
+        info("detected chip %s: %i kbytes\n", chip->name, chip->size / 1024);
+    }
+    return chip;
+}
+
+/**
+ * Opens the input file. Regular files are memory mapped, otherwise
+ * (pipes, stdin passed as '-') the data are streamed.
+ */
+static int inputOpen(InputFile* in, const char* name)
+{
+    struct stat st;
+
+    memset(in, 0, offsetof(InputFile, buf));
+    if (strcmp("-", name) == 0) {
+        in->fd = STDIN_FILENO;
+    } else {
+        in->fd = open(name, O_RDONLY | O_BINARY);
+    }
+    if (in->fd < 0) {
+        return -1;
+    }
+#ifndef MINGW
+    if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // do not map huge files, they can't fit into the chip anyway
+        if (st.st_size > MAX_CHIP_SIZE) {
+            in->size = MAX_CHIP_SIZE + 1;
+            return 0;
+        }
+        // private writable mapping: transforms work in place without changing the file
+        in->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, in->fd, 0);
+        if (in->map == MAP_FAILED) {
+            in->map = NULL;
+        } else {
+            in->size = st.st_size;
+            madvise(in->map, in->size, MADV_SEQUENTIAL);
+        }
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Reads up to 'max' bytes of the streamed input to 'dst'. Returns the number
+ * of bytes read, 0 at the end of the input, or -1 on error.
+ */
+static int inputRead(InputFile* in, uint8_t* dst, uint32_t max)
+{
+    uint32_t len = 0;
+
+    // pipes may return less data than requested: read until the span is full
+    while (len < max) {
+        int ret = read(in->fd, dst + len, max - len);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        len += ret;
+    }
+    in->pos += len;
+    return len;
+}
+
+/**
+ * Returns the next span of the input data up to 'max' bytes long. The span
+ * points directly to the mapped file, or to the staging buffer when streaming.
+ * Returns the length of the span, 0 at the end of the input, or -1 on error.
+ */
+static int inputNext(InputFile* in, uint8_t** span, uint32_t max)
+{
+    uint32_t len;
+
+    if (in->map == NULL) {
+        *span = in->buf;
+        return inputRead(in, in->buf, max);
+    }
+    len = in->size - in->pos;
+    if (len > max) {
+        len = max;
+    }
+    *span = in->map + in->pos;
+    in->pos += len;
+    return len;
+}
+
+/**
+ * Returns the whole input data: either the mapped file or the streamed
+ * data loaded into memory. Returns NULL on error or if the data are too big.
+ */
+static uint8_t* inputLoad(InputFile* in, uint32_t* size)
+{
+    uint8_t* span;
+    int len;
+
+    if (in->map) {
+        *size = in->size;
+        return in->map;
+    }
+    if (in->size > MAX_CHIP_SIZE) {
+        return NULL;
+    }
+    in->data = malloc(MAX_CHIP_SIZE + IN_BUF_SIZE);
+    if (in->data == NULL) {
+        printf("Error: out of memory\n");
+        return NULL;
+    }
+    while ((len = inputNext(in, &span, IN_BUF_SIZE)) > 0) {
+        if (in->pos > MAX_CHIP_SIZE) {
+            return NULL;
+        }
+        memcpy(in->data + in->pos - len, span, len);
+    }
+    *size = in->pos;
+    return len < 0 ? NULL : in->data;
+}
+
+static void inputClose(InputFile* in)
+{
+    free(in->data);
+#ifndef MINGW
+    if (in->map) {
+        munmap(in->map, in->size);
+    }
+#endif
+    if (in->fd != STDIN_FILENO) {
+        close(in->fd);
+    }
+}
+
+// returns the format of the file to write based on its extension
+static int getFileFormat(const char* name)
+{
+    static const char* const srecExt[] = { "srec", "s19", "s28", "s37", "mot", NULL };
+    const char* ext = strrchr(name, '.');
+    int i;
+
+    if (ext == NULL) {
+        return FORMAT_BINARY;
+    }
+    ext++;
+    if (strcasecmp(ext, "hex") == 0 || strcasecmp(ext, "ihx") == 0) {
+        return FORMAT_IHEX;
+    }
+    for (i = 0; srecExt[i] != NULL; i++) {
+        if (strcasecmp(ext, srecExt[i]) == 0) {
+            return FORMAT_SREC;
+        }
+    }
+    return FORMAT_BINARY;
+}
+
+// parses 'cnt' hex encoded bytes
+static int parseHexBytes(const char* text, uint8_t* dst, int cnt)
+{
+    int i;
+    for (i = 0; i < cnt; i++) {
+        unsigned int v;
+        if (!isxdigit(text[0]) || !isxdigit(text[1]) || sscanf(text, "%2x", &v) != 1) {
+            return -1;
+        }
+        dst[i] = (uint8_t) v;
+        text += 2;
+    }
+    return 0;
+}
+
+// adds the data bytes to the sparse image
+static int imageAdd(SparseImage* img, uint32_t addr, const uint8_t* buf, uint32_t len)
+{
+    Extent* last = img->count ? &img->extents[img->count - 1] : NULL;
+
+    if (len == 0) {
+        return 0;
+    }
+    // the addresses come from the file: 'addr + len' could wrap around
+    if (addr >= MAX_CHIP_SIZE || len > MAX_CHIP_SIZE - addr) {
+        return -1;
+    }
+    memcpy(img->data + addr, buf, len);
+
+    // records typically follow each other: just extend the last extent
+    if (last != NULL && last->start + last->len == addr) {
+        last->len += len;
+        return 0;
+    }
+    if (img->count == img->capacity) {
+        int capacity = img->capacity ? img->capacity * 2 : 64;
+        Extent* extents = realloc(img->extents, capacity * sizeof(Extent));
+        if (extents == NULL) {
+            printf("Error: out of memory\n");
+            return -1;
+        }
+        img->extents = extents;
+        img->capacity = capacity;
+    }
+    img->extents[img->count].start = addr;
+    img->extents[img->count].len = len;
+    img->count++;
+    return 0;
+}
+
+static int compareExtents(const void* a, const void* b)
+{
+    uint32_t sa = ((const Extent*) a)->start;
+    uint32_t sb = ((const Extent*) b)->start;
+    return (sa > sb) - (sa < sb);
+}
+
+// sorts the extents and merges the adjacent and overlapping ones
+static void imageMergeExtents(SparseImage* img)
+{
+    int i, j = 0;
+
+    if (img->count == 0) {
+        return;
+    }
+    qsort(img->extents, img->count, sizeof(Extent), compareExtents);
+    for (i = 1; i < img->count; i++) {
+        Extent* e = &img->extents[j];
+        Extent* n = &img->extents[i];
+        if (n->start <= e->start + e->len) {
+            uint32_t end = n->start + n->len;
+            if (end > e->start + e->len) {
+                e->len = end - e->start;
+            }
+        } else {
+            img->extents[++j] = *n;
+        }
+    }
+    img->count = j + 1;
+}
+
+// parses one line of an Intel HEX file
+static int parseIhexLine(SparseImage* img, const char* line, uint32_t* base)
+{
+    uint8_t rec[256 + 5];
+    uint8_t sum = 0;
+    int len, i;
+
+    if (line[0] != ':' || parseHexBytes(line + 1, rec, 1)) {
+        return -1;
+    }
+    len = rec[0];
+    if (parseHexBytes(line + 3, rec + 1, len + 4)) {
+        return -1;
+    }
+    for (i = 0; i < len + 5; i++) {
+        sum += rec[i];
+    }
+    if (sum != 0) {
+        return -1;
+    }
+    switch (rec[3]) {
+        case 0: // data
+            return imageAdd(img, *base + ((rec[1] << 8) | rec[2]), rec + 4, len);
+        case 1: // end of file
+            return 1;
+        case 2: // extended segment address
+            *base = ((rec[4] << 8) | rec[5]) << 4;
+            break;
+        case 4: // extended linear address
+            *base = ((rec[4] << 8) | rec[5]) << 16;
+            break;
+        default: // start addresses are ignored
+            break;
+    }
+    return 0;
+}
+
+// parses one line of a Motorola S-record file
+static int parseSrecLine(SparseImage* img, const char* line)
+{
+    uint8_t rec[256];
+    uint8_t sum = 0;
+    uint32_t addr = 0;
+    int addrLen, i;
+
+    if (line[0] != 'S' || parseHexBytes(line + 2, rec, 1)) {
+        return -1;
+    }
+    switch (line[1]) {
+        case '1': addrLen = 2; break;
+        case '2': addrLen = 3; break;
+        case '3': addrLen = 4; break;
+        case '7': case '8': case '9': return 1; // termination record
+        default: return 0; // header and record counts are ignored
+    }
+    if (rec[0] < addrLen + 1 || parseHexBytes(line + 4, rec + 1, rec[0])) {
+        return -1;
+    }
+    for (i = 0; i <= rec[0]; i++) {
+        sum += rec[i];
+    }
+    if (sum != 0xFF) {
+        return -1;
+    }
+    for (i = 0; i < addrLen; i++) {
+        addr = (addr << 8) | rec[1 + i];
+    }
+    return imageAdd(img, addr, rec + 1 + addrLen, rec[0] - addrLen - 1);
+}
+
+/**
+ * Loads an Intel HEX or S-record file into a sparse image.
+ * The file is parsed line by line as it is read.
+ */
+static int loadSparseImage(SparseImage* img, const char* name, int format)
+{
+    char line[1024];
+    uint32_t base = 0;
+    int lineNum = 0;
+    int ret = 0;
+    FILE* f;
+
+    memset(img, 0, sizeof(SparseImage));
+    // the stdin stream is not used: in the daemon the standard input of each
+    // job is a new descriptor, the EOF flag and the buffer must not carry over
+    if (strcmp("-", name) == 0) {
+        int fd = dup(STDIN_FILENO);
+        f = (fd >= 0) ? fdopen(fd, "r") : NULL;
+        if (f == NULL && fd >= 0) {
+            close(fd);
+        }
+    } else {
+        f = fopen(name, "r");
+    }
+    if (f == NULL) {
+        return -1;
+    }
+    img->data = malloc(MAX_CHIP_SIZE);
+    if (img->data == NULL) {
+        printf("Error: out of memory\n");
+        fclose(f);
+        return -1;
+    }
+    memset(img->data, 0xFF, MAX_CHIP_SIZE);
+
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        char* text = line;
+        lineNum++;
+        while (isspace(*text)) {
+            text++;
+        }
+        if (*text == 0) {
+            continue;
+        }
+        ret = (format == FORMAT_IHEX) ? parseIhexLine(img, text, &base) : parseSrecLine(img, text);
+        if (ret < 0) {
+            printf("Error: invalid record or address on line %i of file %s\n", lineNum, name);
+        }
+    }
+    fclose(f);
+    imageMergeExtents(img);
+    // an empty input (e.g. a failed producer of the pipe) is not written as success
+    if (ret >= 0 && img->count == 0) {
+        printf("Error: no data records in file %s\n", name);
+        ret = -1;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+static void freeSparseImage(SparseImage* img)
+{
+    free(img->data);
+    free(img->extents);
+}
+
+// State of a write job shared by the binary and sparse write paths
+typedef struct {
+    Cf840Device* dev;
+    int flags;          // CF840_WRITE_* flags of the whole job
+    char started;       // sectors erased by the earlier extents are kept
+    char verify;        // each block is read back right after writing it
+    char dryRun;        // the extents are only added to the checksum
+    char journal[1024]; // name of the journal file, empty: no journal
+    uint32_t crc;       // identifies the image: CRC of the extents and their addresses
+    unsigned options;   // JOURNAL_* options the image is written with
+    uint32_t total;     // bytes of all extents
+    uint32_t done;      // bytes written (and verified) completely
+    uint32_t skip;      // bytes written by the interrupted write (-resume)
+} WriteJob;
+
+// pipeline of the running read or streamed write, receives the progress
+static __thread Pipeline* progressPipe = NULL;
+
+static void printProgress(int op, uint32_t pos)
+{
+    static const char* const names[4] = { "", "Read", "Write", "Verify" };
+
+    if (!quiet) {
+        info("%s chunk %i addr=%04x bank=%02x \r", names[op], pos, pos & 0xFFFF, (pos >> 16) & 0xFF);
+    }
+}
+
+// prints the progress of the read, write and verify operations. During
+// a pipeline the worker prints it, the terminal must not stall the USB.
+static void showProgress(void* user, int op, uint32_t pos, uint32_t done, uint32_t total)
+{
+    if (progressPipe) {
+        atomic_store_explicit(&progressPipe->progress, ((uint32_t) op << 28) | pos, memory_order_relaxed);
+    } else {
+        printProgress(op, pos);
+    }
+}
+
+// prints the progress stored by the USB thread, if it changed
+static void pipeProgress(Pipeline* pipe)
+{
+    uint32_t v = atomic_exchange_explicit(&pipe->progress, 0, memory_order_relaxed);
+
+    if (v) {
+        printProgress(v >> 28, v & 0x0FFFFFFF);
+    }
+}
+
+static void ringPush(Ring* r, Block* b)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    r->slots[head % PIPE_BLOCKS] = b;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// returns the oldest block of the ring or NULL when it is empty
+static Block* ringPop(Ring* r)
+{
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    Block* b;
+
+    if (tail == atomic_load_explicit(&r->head, memory_order_acquire)) {
+        return NULL;
+    }
+    b = r->slots[tail % PIPE_BLOCKS];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return b;
+}
+
+/**
+ * Waits for a block of the ring. The worker prints the progress meanwhile
+ * and gives up (returns NULL) when the USB thread stops the pipeline.
+ */
+static Block* ringWait(Pipeline* pipe, Ring* r, int worker)
+{
+    Block* b;
+    int spins = 0;
+
+    while ((b = ringPop(r)) == NULL) {
+        if (worker) {
+            if (atomic_load(&pipe->stop)) {
+                return NULL;
+            }
+            pipeProgress(pipe);
+        }
+        // the blocks take ~ 30 ms over USB: sleep once a short spin is over
+        if (++spins < 16) {
+            sched_yield();
+        } else {
+            usleep(200);
+        }
+    }
+    return b;
+}
+
+// starts the worker of a pipeline, all the blocks are empty. Returns NULL on error.
+static Pipeline* pipeStart(void* (*worker)(void*), void* user)
+{
+    Pipeline* pipe = malloc(sizeof(Pipeline));
+    int i;
+
+    if (pipe == NULL) {
+        info("Error: out of memory\n");
+        return NULL;
+    }
+    // the blocks are filled by the stages, only the rings and flags are cleared
+    memset(&pipe->full, 0, sizeof(Pipeline) - offsetof(Pipeline, full));
+    for (i = 0; i < PIPE_BLOCKS; i++) {
+        pipe->blocks[i].done = 0;
+        ringPush(&pipe->empty, &pipe->blocks[i]);
+    }
+    pipe->label = devLabel;
+    pipe->user = user;
+    if (pthread_create(&pipe->thread, NULL, worker, pipe)) {
+        free(pipe);
+        info("Error: failed to start the pipeline worker\n");
+        return NULL;
+    }
+    progressPipe = pipe;
+    return pipe;
+}
+
+// waits for the worker; 'cancel' interrupts its blocking read of the input
+static void pipeStop(Pipeline* pipe, int cancel)
+{
+    atomic_store(&pipe->stop, 1);
+    if (cancel) {
+        pthread_cancel(pipe->thread);
+    }
+    pthread_join(pipe->thread, NULL);
+    progressPipe = NULL;
+    pipeProgress(pipe);
+    free(pipe);
+}
+
+// collects the durations measured during the action. The data of a sector
+// are written by several calls (per journal block): their times are summed.
+static void recordTiming(void* user, int op, uint32_t addr, uint32_t len, uint32_t us)
+{
+    Programmer* p = (Programmer*) user;
+    int i;
+
+    for (i = 0; op == CF840_OP_WRITE && i < p->sampleCnt; i++) {
+        if (p->samples[i].op == op && p->samples[i].addr == addr) {
+            p->samples[i].len += len;
+            p->samples[i].us += us;
+            return;
+        }
+    }
+    if (p->sampleCnt < MAX_SAMPLES) {
+        TimingSample* t = &p->samples[p->sampleCnt++];
+        t->op = op;
+        t->addr = addr;
+        t->len = len;
+        t->us = us;
+    }
+}
+
+// name of the database of the erase and program durations
+static void getTimingName(char* name, int size)
+{
+    const char* home = getenv("HOME");
+    snprintf(name, size, "%s/.prog_pc_timing", home ? home : ".");
+}
+
+/**
+ * Loads the timing database. Returns the records (free them) and their
+ * number in 'cnt', the missing database is empty. 'cnt' is -1 on error.
+ */
+static TimingRecord* loadTimings(int* cnt)
+{
+    char name[1024];
+    char line[256];
+    char sector[16];
+    TimingRecord* list = NULL;
+    TimingRecord r;
+    FILE* f;
+    int capacity = 0;
+
+    *cnt = 0;
+    getTimingName(name, sizeof(name));
+    f = fopen(name, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%63s %x %x %15s %u %u %u %u %u %u %u",
+            r.label, &r.manufId, &r.deviceId, sector, &r.erases, &r.eraseFirst, &r.eraseLast,
+            &r.eraseMax, &r.writes, &r.progFirst, &r.progLast) != 11
+        ) {
+            continue;
+        }
+        r.sector = strcmp(sector, "chip") ? (uint32_t) strtoul(sector, NULL, 16) : TIMING_CHIP;
+        if (*cnt == capacity) {
+            TimingRecord* grown;
+            capacity = capacity ? capacity * 2 : 64;
+            grown = realloc(list, capacity * sizeof(TimingRecord));
+            if (grown == NULL) {
+                info("Error: out of memory\n");
+                free(list);
+                fclose(f);
+                *cnt = -1;
+                return NULL;
+            }
+            list = grown;
+        }
+        list[(*cnt)++] = r;
+    }
+    fclose(f);
+    return list;
+}
+
+// finds the record of the sector, adds a new one if not found (NULL: out of memory)
+static TimingRecord* findTiming(TimingRecord** list, int* cnt, const char* label, uint8_t manufId, uint8_t deviceId, uint32_t sector)
+{
+    TimingRecord* r;
+    int i;
+
+    for (i = 0; i < *cnt; i++) {
+        r = &(*list)[i];
+        if (r->sector == sector && r->manufId == manufId && r->deviceId == deviceId && strcmp(r->label, label) == 0) {
+            return r;
+        }
+    }
+    r = realloc(*list, (*cnt + 1) * sizeof(TimingRecord));
+    if (r == NULL) {
+        return NULL;
+    }
+    *list = r;
+    r = &(*list)[(*cnt)++];
+    memset(r, 0, sizeof(TimingRecord));
+    snprintf(r->label, sizeof(r->label), "%s", label);
+    r->manufId = manufId;
+    r->deviceId = deviceId;
+    r->sector = sector;
+    return r;
+}
+
+static void addErase(TimingRecord* r, unsigned ms)
+{
+    r->erases++;
+    if (r->eraseFirst == 0) {
+        r->eraseFirst = ms;
+    }
+    r->eraseLast = ms;
+    if (ms > r->eraseMax) {
+        r->eraseMax = ms;
+    }
+}
+
+/**
+ * Adds the durations collected by the action to the timing database.
+ * The chip erases count as erases of all the sectors of the chip.
+ */
+static void saveTimings(Programmer* p)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    char label[sizeof(((TimingRecord*) NULL)->label)];
+    char name[1024];
+    char tmpName[1040];
+    TimingRecord* list;
+    TimingRecord* r;
+    uint32_t start, size;
+    int failed;
+    int cnt;
+    int i;
+    FILE* f;
+
+    if (p->sampleCnt == 0) {
+        return;
+    }
+    // the modules of a gang are told apart by the programmer
+    if (snprintf(label, sizeof(label), gang ? "%s@%s" : "%s", moduleLabel, p->path) >= (int) sizeof(label)) {
+        info("Warning: the label %s@%s is too long, the durations are not saved\n", moduleLabel, p->path);
+        return;
+    }
+    if (!p->chipKnown) {
+        getChip(p->dev);
+    }
+
+    pthread_mutex_lock(&lock);
+    list = loadTimings(&cnt);
+    // a database which failed to load or grow is not overwritten
+    failed = (cnt < 0);
+    for (i = 0; i < p->sampleCnt && !failed; i++) {
+        TimingSample* t = &p->samples[i];
+        if (t->op == CF840_OP_ERASE && t->len > 0x10000) {
+            r = findTiming(&list, &cnt, label, p->manufId, p->deviceId, TIMING_CHIP);
+            failed = (r == NULL);
+            if (r != NULL) {
+                addErase(r, t->us / 1000);
+            }
+            for (start = 0; !failed && p->chip && start < p->chip->size; start += size) {
+                cf840GetSector(p->chip, start, &start, &size);
+                r = findTiming(&list, &cnt, label, p->manufId, p->deviceId, start);
+                failed = (r == NULL);
+                if (r != NULL) {
+                    r->erases++;
+                }
+            }
+        } else
+        if (t->op == CF840_OP_ERASE) {
+            r = findTiming(&list, &cnt, label, p->manufId, p->deviceId, t->addr);
+            failed = (r == NULL);
+            if (r != NULL) {
+                addErase(r, t->us / 1000);
+            }
+        } else
+        if (t->len >= 256) {
+            // short writes are dominated by the USB transfers
+            unsigned ns = (unsigned) ((uint64_t) t->us * 1000 / t->len);
+            r = findTiming(&list, &cnt, label, p->manufId, p->deviceId, t->addr);
+            failed = (r == NULL);
+            if (r != NULL) {
+                r->writes++;
+                if (r->progFirst == 0) {
+                    r->progFirst = ns;
+                }
+                r->progLast = ns;
+            }
+        }
+    }
+    p->sampleCnt = 0;
+    if (failed) {
+        info("Warning: the durations are not saved\n");
+        pthread_mutex_unlock(&lock);
+        free(list);
+        return;
+    }
+
+    // the database is replaced at once: an interrupted save keeps the old one
+    getTimingName(name, sizeof(name));
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", name);
+    f = fopen(tmpName, "w");
+    if (f != NULL) {
+        fprintf(f, "# label manuf device sector erases erase_first_ms erase_last_ms erase_max_ms writes program_first_ns program_last_ns\n");
+        for (i = 0; i < cnt; i++) {
+            r = &list[i];
+            fprintf(f, "%s %02x %02x ", r->label, r->manufId, r->deviceId);
+            if (r->sector == TIMING_CHIP) {
+                fprintf(f, "chip");
+            } else {
+                fprintf(f, "%06x", r->sector);
+            }
+            fprintf(f, " %u %u %u %u %u %u %u\n", r->erases, r->eraseFirst, r->eraseLast, r->eraseMax,
+                r->writes, r->progFirst, r->progLast);
+        }
+        if (fclose(f) == 0) {
+            rename(tmpName, name);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    free(list);
+}
+
+// checks the duration against the limit and the first recorded one
+static const char* timingFlag(unsigned first, unsigned last, unsigned limit)
+{
+    if (last * 100 >= limit * TIMING_WARN_PERCENT) {
+        return "near limit";
+    }
+    if (first && last >= first * TIMING_DRIFT) {
+        return "drifting";
+    }
+    return NULL;
+}
+
+static int sameModule(const TimingRecord* x, const TimingRecord* y)
+{
+    return x->manufId == y->manufId && x->deviceId == y->deviceId && strcmp(x->label, y->label) == 0;
+}
+
+// orders the records by module, the chip erases after the sectors
+static int compareTimings(const void* a, const void* b)
+{
+    const TimingRecord* x = (const TimingRecord*) a;
+    const TimingRecord* y = (const TimingRecord*) b;
+    int ret = strcmp(x->label, y->label);
+
+    if (ret == 0) {
+        ret = (int) ((x->manufId << 8) | x->deviceId) - (int) ((y->manufId << 8) | y->deviceId);
+    }
+    if (ret == 0) {
+        ret = (x->sector > y->sector) - (x->sector < y->sector);
+    }
+    return ret;
+}
+
+/**
+ * Prints the timing database module by module and flags the sectors whose
+ * erase or program durations approach the limits or drift from the first
+ * recorded ones. Returns 1 when a module is flagged.
+ */
+static int printTimings(void)
+{
+    TimingRecord* list;
+    int cnt;
+    int flagged = 0;
+    int i, j;
+
+    list = loadTimings(&cnt);
+    if (cnt < 0) {
+        return 1;
+    }
+    if (cnt == 0) {
+        info("no durations recorded yet\n");
+        return 0;
+    }
+    qsort(list, cnt, sizeof(TimingRecord), compareTimings);
+    for (i = 0; i < cnt; i = j) {
+        const Cf840ChipInfo* chip = cf840FindChip(list[i].deviceId);
+        unsigned erases = 0;
+        int bad = 0;
+
+        printf("module %s, chip %02x:%02x %s\n", list[i].label, list[i].manufId, list[i].deviceId,
+            chip ? chip->name : "(unknown)");
+        for (j = i; j < cnt && sameModule(&list[j], &list[i]); j++) {
+            TimingRecord* r = &list[j];
+            const char* eraseFlag = timingFlag(r->eraseFirst, r->eraseLast, ERASE_LIMIT_MS);
+            const char* progFlag = timingFlag(r->progFirst, r->progLast, PROGRAM_LIMIT_NS);
+
+            if (r->sector == TIMING_CHIP) {
+                printf("  chip  ");
+            } else {
+                printf("  %06x", r->sector);
+                erases += r->erases;
+            }
+            printf(" %5u erases, erase %u/%u/%u ms, program %.1f/%.1f us/byte",
+                r->erases, r->eraseFirst, r->eraseLast, r->eraseMax, r->progFirst / 1000.0, r->progLast / 1000.0);
+            if (eraseFlag) {
+                printf("  SLOW erase: %s", eraseFlag);
+            }
+            if (progFlag) {
+                printf("  SLOW program: %s", progFlag);
+            }
+            printf("\n");
+            bad |= (eraseFlag || progFlag);
+        }
+        printf("  %u sector erases: %s\n\n", erases, bad ? "CHECK THE MODULE" : "OK");
+        flagged |= bad;
+    }
+    free(list);
+    return flagged;
+}
+
+// RLE transfers are used when the firmware reports them, -rle asks for them
+// (the library still ignores them when the firmware does not report them)
+static int rleEnabled(Cf840Device* dev, int cap)
+{
+    return useRle || (cf840GetCapabilities(dev)->caps & cap);
+}
+
+// CRC32 (IEEE 802.3) lookup table, the same checksum as zip or 'crc32' tool
+static void crcInit(void)
+{
+    uint32_t i, j, c;
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crcTable[i] = c;
+    }
+}
+
+static uint32_t crcUpdate(uint32_t crc, const uint8_t* buf, uint32_t len)
+{
+    while (len--) {
+        crc = crcTable[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// records the bytes completed by the write, so it can be resumed later
+static void journalSave(WriteJob* job, uint32_t done)
+{
+    FILE* f;
+
+    if (job->journal[0] == 0) {
+        return;
+    }
+    f = fopen(job->journal, "w");
+    if (f == NULL) {
+        info("Warning: can't write the journal %s\n", job->journal);
+        job->journal[0] = 0;
+        return;
+    }
+    fprintf(f, "%08x %u %u %x\n", job->crc, job->total, done, job->options);
+    fclose(f);
+}
+
+/**
+ * Writes a continuous range of data in blocks of JOURNAL_BLOCK bytes and
+ * counts the completed blocks in 'done' (the worker of writePrefetched()
+ * records them in the journal). The library splits them to chunks aligned
+ * to 64 bytes and erases the sectors with -esec.
+ */
+static int writeExtent(WriteJob* job, const uint8_t* data, uint32_t start, uint32_t len)
+{
+    uint32_t badAddr = start;
+    uint32_t n = 0;
+    int ret = CF840_OK;
+
+    if (job->dryRun) {
+        job->crc = crcUpdate(job->crc, (const uint8_t*) &start, sizeof(start));
+        job->crc = crcUpdate(job->crc, data, len);
+        job->total += len;
+        return 0;
+    }
+    // the bytes written by the interrupted write are skipped,
+    // their sectors must not be erased again
+    n = (job->skip < len) ? job->skip : len;
+    if (n) {
+        if (job->flags & CF840_WRITE_ERASE) {
+            cf840MarkErased(job->dev, start, n);
+        }
+        job->skip -= n;
+        job->done += n;
+        data += n;
+        start += n;
+        len -= n;
+    }
+    while (len && ret == CF840_OK) {
+        n = JOURNAL_BLOCK - (start % JOURNAL_BLOCK);
+        if (n > len) {
+            n = len;
+        }
+        ret = cf840Write(job->dev, start, data, n, job->flags | (job->started ? CF840_WRITE_APPEND : 0));
+        job->started = 1;
+        if (ret == CF840_OK && job->verify) {
+            ret = cf840Verify(job->dev, start, data, n, &badAddr);
+            if (ret == CF840_ERROR_VERIFY) {
+                info("\nVerify failed at address=0x%06x: expected 0x%02x\n", badAddr, data[badAddr - start]);
+            }
+        }
+        if (ret == CF840_OK) {
+            job->done += n;
+            data += n;
+            start += n;
+            len -= n;
+        }
+    }
+    if (ret != CF840_OK && ret != CF840_ERROR_VERIFY) {
+        info("\nError: %s at address range 0x%06x-0x%06x\n", cf840ErrorName(ret), start, start + n - 1);
+    }
+    return ret ? -1 : 0;
+}
+
+// Swaps the bytes of 16 bit words in place, 8 bytes at a time.
+static void swapWordBytes(uint8_t* buf, uint32_t len)
+{
+    uint32_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, buf + i, 8);
+        v = ((v & 0x00FF00FF00FF00FFULL) << 8) | ((v >> 8) & 0x00FF00FF00FF00FFULL);
+        memcpy(buf + i, &v, 8);
+    }
+    for (; i + 2 <= len; i += 2) {
+        uint8_t t = buf[i];
+        buf[i] = buf[i + 1];
+        buf[i + 1] = t;
+    }
+}
+
+// Merges 'len' even and 'len' odd bytes into 'dst'.
+// Simple loops like this one are vectorized by the compiler.
+static void interleave(uint8_t* dst, const uint8_t* even, const uint8_t* odd, uint32_t len)
+{
+    uint32_t i;
+    for (i = 0; i < len; i++) {
+        dst[2 * i] = even[i];
+        dst[2 * i + 1] = odd[i];
+    }
+}
+
+// Splits '2 * len' bytes of 'src' into even and odd bytes.
+static void deinterleave(uint8_t* even, uint8_t* odd, const uint8_t* src, uint32_t len)
+{
+    uint32_t i;
+    for (i = 0; i < len; i++) {
+        even[i] = src[2 * i];
+        odd[i] = src[2 * i + 1];
+    }
+}
+
+// checks the data of 'size' bytes can be split to the banks
+static int checkBankSize(uint32_t size)
+{
+    if (bankCount && (size % (bankCount * 64))) {
+        printf("Error: size %u can't be split to %i banks of 64 byte blocks\n", size, bankCount);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the data of the whole image (binary file) at the -ofs address.
+ * With -banks each bank of the file is written directly to its reordered
+ * location in the chip.
+ */
+static int writeImage(WriteJob* job, const uint8_t* data, uint32_t size)
+{
+    uint32_t bankSize;
+    int i;
+
+    if (bankCount == 0) {
+        return writeExtent(job, data, rwOffset, size);
+    }
+    bankSize = size / bankCount;
+    for (i = 0; i < bankCount; i++) {
+        if (writeExtent(job, data + bankOrder[i] * bankSize, rwOffset + i * bankSize, bankSize)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Source of writePrefetched(): the populated ranges of the sparse image
+// or the whole (bank reordered) binary image
+typedef struct {
+    WriteJob* job;
+    SparseImage* img;
+    const uint8_t* data;
+    uint32_t size;
+} ImageSource;
+
+// saves the journal when a block coming back completed more bytes
+static void journalBlock(WriteJob* job, Block* b, uint32_t* saved)
+{
+    if (b->done > *saved) {
+        *saved = b->done;
+        journalSave(job, b->done);
+    }
+}
+
+// reads a byte of each page of the data, so the mapped file is paged in
+static void touchPages(const uint8_t* data, uint32_t len)
+{
+    const volatile uint8_t* p = data;
+    uint32_t i;
+
+    for (i = 0; i < len; i += 4096) {
+        (void) p[i];
+    }
+    if (len) {
+        (void) p[len - 1];
+    }
+}
+
+/**
+ * Worker of the write of a mapped or loaded image: passes the ranges of the
+ * image to the USB thread as pointers, after touching their pages (the page
+ * faults of a mapped file happen here), and records the blocks written by
+ * the USB thread in the journal.
+ */
+static void* imageWorker(void* arg)
+{
+    Pipeline* pipe = (Pipeline*) arg;
+    ImageSource* src = (ImageSource*) pipe->user;
+    SparseImage* img = src->img;
+    int count = img->data ? img->count : (bankCount ? bankCount : 1);
+    uint32_t bankSize = bankCount ? src->size / bankCount : src->size;
+    uint32_t saved = src->job->done;
+    const uint8_t* data;
+    uint32_t start, len, n;
+    Block* b;
+    int i;
+
+    devLabel = pipe->label;
+    for (i = 0; i < count; i++) {
+        if (img->data) {
+            start = img->extents[i].start;
+            len = img->extents[i].len;
+            data = img->data + start;
+        } else {
+            start = rwOffset + i * bankSize;
+            len = bankSize;
+            data = src->data + (bankCount ? bankOrder[i] : 0) * bankSize;
+        }
+        // the blocks match the journal blocks of writeExtent()
+        while (len) {
+            n = JOURNAL_BLOCK - (start % JOURNAL_BLOCK);
+            if (n > len) {
+                n = len;
+            }
+            b = ringWait(pipe, &pipe->empty, 1);
+            if (b == NULL) {
+                return NULL;
+            }
+            journalBlock(src->job, b, &saved);
+            touchPages(data, n);
+            b->data = data;
+            b->pos = start;
+            b->len = n;
+            b->error = 0;
+            ringPush(&pipe->full, b);
+            data += n;
+            start += n;
+            len -= n;
+        }
+    }
+    b = ringWait(pipe, &pipe->empty, 1);
+    if (b == NULL) {
+        return NULL;
+    }
+    journalBlock(src->job, b, &saved);
+    b->len = 0;
+    b->error = 0;
+    ringPush(&pipe->full, b);
+    // the USB thread still writes the queued blocks: keep the journal and the progress
+    while (!atomic_load(&pipe->stop)) {
+        while ((b = ringPop(&pipe->empty)) != NULL) {
+            journalBlock(src->job, b, &saved);
+        }
+        pipeProgress(pipe);
+        usleep(20 * 1000);
+    }
+    while ((b = ringPop(&pipe->empty)) != NULL) {
+        journalBlock(src->job, b, &saved);
+    }
+    return NULL;
+}
+
+/**
+ * Writes the mapped or loaded image. The worker pages the data in ahead
+ * and saves the journal, the USB thread waits only for the programmer.
+ * The blocks carry pointers into the image, the data are not copied.
+ */
+static int writePrefetched(WriteJob* job, SparseImage* img, const uint8_t* data, uint32_t dataSize)
+{
+    ImageSource src;
+    Pipeline* pipe;
+    Block* b;
+    int result = 0;
+
+    src.job = job;
+    src.img = img;
+    src.data = data;
+    src.size = dataSize;
+    pipe = pipeStart(imageWorker, &src);
+    if (pipe == NULL) {
+        return -1;
+    }
+    while (1) {
+        b = ringWait(pipe, &pipe->full, 0);
+        if (b->len == 0) {
+            break;
+        }
+        if (writeExtent(job, b->data, b->pos, b->len)) {
+            result = -1;
+            break;
+        }
+        b->done = job->done;
+        ringPush(&pipe->empty, b);
+    }
+    pipeStop(pipe, 0);
+    return result;
+}
+
+/**
+ * Writes either the populated ranges of the sparse image or the whole
+ * binary image. Streamed data are not handled here. The dry run of
+ * journalStart() walks the data directly, the write goes through
+ * writePrefetched().
+ */
+static int writeSparseOrImage(WriteJob* job, SparseImage* img, const uint8_t* data, uint32_t dataSize, uint32_t* pos)
+{
+    int result = 0;
+    int i;
+
+    if (!job->dryRun && (img->data != NULL || data != NULL)) {
+        result = writePrefetched(job, img, data, dataSize);
+        *pos = dataSize;
+        for (i = 0; img->data != NULL && i < img->count; i++) {
+            *pos += img->extents[i].len;
+        }
+        return result;
+    }
+    if (img->data != NULL) {
+        // only the populated ranges are written
+        *pos = 0;
+        for (i = 0; i < img->count && result == 0; i++) {
+            result = writeExtent(job, img->data + img->extents[i].start, img->extents[i].start, img->extents[i].len);
+            *pos += img->extents[i].len;
+        }
+    } else
+    if (data != NULL) {
+        // the whole mapped (or transformed) image
+        result = writeImage(job, data, dataSize);
+        *pos = dataSize;
+    }
+    return result;
+}
+
+/**
+ * Starts the journal of the write. The image is identified by the CRC of
+ * its extents. With -resume the bytes completed by the interrupted write
+ * of the same image are skipped. Returns 0 on success.
+ */
+static int journalStart(WriteJob* job, SparseImage* img, const uint8_t* data, uint32_t dataSize)
+{
+    uint32_t crc, total, done;
+    unsigned options;
+    uint32_t pos;
+    FILE* f;
+    int ret;
+
+    getJournalName(job->dev, job->journal, sizeof(job->journal));
+    // the bytes written with other options can't be skipped
+    job->options = ((job->flags & CF840_WRITE_ERASE) ? JOURNAL_ERASE_SECTORS : 0) |
+        (job->verify ? JOURNAL_VERIFY : 0) | (swapBytes ? JOURNAL_SWAP : 0);
+    job->dryRun = 1;
+    job->crc = 0xFFFFFFFF;
+    writeSparseOrImage(job, img, data, dataSize, &pos);
+    job->dryRun = 0;
+    if (!resumeWrite) {
+        journalSave(job, 0);
+        return 0;
+    }
+
+    f = fopen(job->journal, "r");
+    ret = f ? fscanf(f, "%x %u %u %x", &crc, &total, &done, &options) : 0;
+    if (f) {
+        fclose(f);
+    }
+    if (ret != 4 || done >= total) {
+        printf("Error: no interrupted write to resume\n");
+        return -1;
+    }
+    if (crc != job->crc || total != job->total || options != job->options) {
+        printf("Error: the interrupted write used different data or options\n");
+        return -1;
+    }
+    info("Resuming the write at byte %u of %u\n", done, total);
+    job->skip = done;
+    // the sectors of the skipped bytes are marked as erased by this write
+    cf840MarkErased(job->dev, 0, 0);
+    job->started = 1;
+    return 0;
+}
+
+/**
+ * Loads the image for the write. The transforms which need the whole
+ * image (interleaving of two files, bank reordering) are applied here.
+ * Returns NULL when the data should be streamed.
+ */
+static uint8_t* loadImage(InputFile* in, InputFile* in2, uint32_t* size, uint8_t** merged)
+{
+    uint8_t* data;
+    uint8_t* data2;
+    uint32_t size2;
+
+    *merged = NULL;
+    if (fname2[0] == 0) {
+        if (in->map == NULL && bankCount == 0) {
+            return NULL;
+        }
+        data = inputLoad(in, size);
+        if (data == NULL) {
+            printf("Error: failed to load file: %s\n", fname);
+        }
+        return data;
+    }
+
+    data = inputLoad(in, size);
+    data2 = inputLoad(in2, &size2);
+    if (data == NULL || data2 == NULL || *size != size2 || *size * 2 > MAX_CHIP_SIZE) {
+        printf("Error: files %s and %s must be of the same size and fit into the chip\n", fname, fname2);
+        return NULL;
+    }
+    *merged = malloc(*size * 2);
+    if (*merged == NULL) {
+        printf("Error: out of memory\n");
+        return NULL;
+    }
+    interleave(*merged, data, data2, *size);
+    *size *= 2;
+    return *merged;
+}
+
+/**
+ * Worker of the streamed write: reads the input and swaps the bytes. The read
+ * can be cancelled only while it waits for the input, the rings stay intact.
+ */
+static void* streamWorker(void* arg)
+{
+    Pipeline* pipe = (Pipeline*) arg;
+    InputFile* in = (InputFile*) pipe->user;
+    uint32_t pos = rwOffset;
+    Block* b;
+    int state;
+    int len;
+
+    devLabel = pipe->label;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    while ((b = ringWait(pipe, &pipe->empty, 1)) != NULL) {
+        uint32_t max = IN_BUF_SIZE;
+        if (rwLength && pos - rwOffset + max > rwLength) {
+            max = rwLength - (pos - rwOffset);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+        len = max ? inputRead(in, b->buf, max) : 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+        if (len < 0) {
+            info("\nError reading file %s\n", fname);
+        }
+        // only the last block can be odd: its last byte has no pair
+        if (len > 0 && swapBytes && (len & 1)) {
+            info("\nError: -swap requires an even number of bytes\n");
+            len = -1;
+        }
+        if (len > 0 && swapBytes) {
+            swapWordBytes(b->buf, len);
+        }
+        b->pos = pos;
+        b->len = (len > 0) ? len : 0;
+        b->error = (len < 0);
+        ringPush(&pipe->full, b);
+        if (len <= 0) {
+            break;
+        }
+        pos += len;
+        pipeProgress(pipe);
+    }
+    // the USB thread still writes the queued blocks: keep printing the progress
+    while (b != NULL && !atomic_load(&pipe->stop)) {
+        pipeProgress(pipe);
+        usleep(20 * 1000);
+    }
+    return NULL;
+}
+
+/**
+ * Writes the streamed data (pipe, stdin) as they arrive. The worker reads
+ * the input ahead, so a slow producer does not stall the USB transfers.
+ */
+static int writeStream(WriteJob* job, InputFile* in, uint32_t chipSize)
+{
+    Pipeline* pipe = pipeStart(streamWorker, in);
+    Block* b;
+    int result = 0;
+
+    if (pipe == NULL) {
+        return -1;
+    }
+    while (1) {
+        b = ringWait(pipe, &pipe->full, 0);
+        if (b->len == 0) {
+            result = b->error ? -1 : 0;
+            break;
+        }
+        // streamed data are checked as they arrive
+        if (b->pos + b->len > chipSize) {
+            info("\nError: the data do not fit into the chip (%i bytes)\n", chipSize);
+            result = -1;
+            break;
+        }
+        if (writeExtent(job, b->buf, b->pos, b->len)) {
+            result = -1;
+            break;
+        }
+        ringPush(&pipe->empty, b);
+    }
+    pipeStop(pipe, result != 0);
+    return result;
+}
+
+/**
+ * Writes a file to the flash IC. Binary files are written starting at
+ * address 0, HEX and S-record files only to the addresses they contain.
+ */
+static int writeFlash(Cf840Device* dev)
+{
+    InputFile in;
+    InputFile in2;
+    SparseImage img;
+    WriteJob job;
+    const Cf840ChipInfo* chip;
+    uint8_t* data = NULL;
+    uint8_t* merged = NULL;
+    uint32_t dataSize = 0;
+    int format = getFileFormat(fname);
+    int result = 0;
+    int i;
+    uint32_t chipSize;
+    uint32_t pos = 0;
+    int ret;
+
+    memset(&job, 0, sizeof(job));
+    memset(&img, 0, sizeof(img));
+    in.fd = -1;
+    in2.fd = -1;
+
+    if (format != FORMAT_BINARY && (fname2[0] || bankCount || rwOffset || rwLength)) {
+        printf("Error: -w2, -banks, -ofs and -len can be used only with binary files\n");
+        return -1;
+    }
+    if (format == FORMAT_BINARY) {
+        ret = inputOpen(&in, fname);
+        if (ret == 0 && fname2[0] && inputOpen(&in2, fname2)) {
+            printf("Error: failed to open file: %s\n", fname2);
+            inputClose(&in);
+            return -1;
+        }
+    } else {
+        ret = loadSparseImage(&img, fname, format);
+    }
+    if (ret) {
+        printf("Error: failed to %s file: %s\n", format == FORMAT_BINARY ? "open" : "load", fname);
+        freeSparseImage(&img);
+        return -1;
+    }
+
+    job.dev = dev;
+    job.verify = verifyWrite;
+    job.flags = (slowWrite ? CF840_WRITE_SLOW : 0) | (eraseSectors ? CF840_WRITE_ERASE : 0) |
+        (rleEnabled(dev, CF840_CAP_RLE_WRITE) ? CF840_WRITE_RLE : 0);
+    chip = getChip(dev);
+    chipSize = chip ? chip->size : MAX_CHIP_SIZE;
+    if (format == FORMAT_BINARY) {
+        data = loadImage(&in, &in2, &dataSize, &merged);
+        if (data == NULL && (fname2[0] || bankCount || in.map)) {
+            result = -1;
+        }
+        // -len writes only the beginning of the file
+        if (rwLength && dataSize > rwLength) {
+            dataSize = rwLength;
+        }
+    }
+    if (result) {
+        // the error is already reported
+    } else
+    if (eraseSectors && chip == NULL) {
+        printf("Error: sector layout of the chip is unknown, can't use -esec\n");
+        result = -1;
+    } else
+    if (rwOffset + dataSize > chipSize || (format == FORMAT_BINARY && data == NULL && rwOffset + in.size > chipSize) || (img.count && img.extents[img.count - 1].start + img.extents[img.count - 1].len > chipSize)) {
+        printf("Error: file %s does not fit into the chip (%i bytes)\n", fname, chipSize);
+        result = -1;
+    } else
+    if (data != NULL && checkBankSize(dataSize)) {
+        result = -1;
+    } else
+    if (swapBytes && format == FORMAT_BINARY && ((data != NULL ? dataSize : rwLength) & 1)) {
+        printf("Error: -swap requires an even number of bytes\n");
+        result = -1;
+    }
+    if (result) {
+        goto cleanup;
+    }
+
+    if (swapBytes) {
+        if (data != NULL) {
+            swapWordBytes(data, dataSize);
+        } else
+        if (format != FORMAT_BINARY) {
+            // both bytes of each word touched by the data are written
+            // (0xFF of the unpopulated byte leaves the erased flash intact)
+            swapWordBytes(img.data, MAX_CHIP_SIZE);
+            for (i = 0; i < img.count; i++) {
+                uint32_t end = (img.extents[i].start + img.extents[i].len + 1) & ~1;
+                img.extents[i].start &= ~1;
+                img.extents[i].len = end - img.extents[i].start;
+            }
+            imageMergeExtents(&img);
+        }
+    }
+
+    if (data != NULL || img.data != NULL) {
+        result = journalStart(&job, &img, data, dataSize);
+    } else
+    if (resumeWrite) {
+        printf("Error: -resume can't be used with streamed data\n");
+        result = -1;
+    }
+    if (result) {
+        goto cleanup;
+    }
+
+    result = writeSparseOrImage(&job, &img, data, dataSize, &pos);
+    // streamed data are written as they arrive
+    if (data == NULL && format == FORMAT_BINARY) {
+        result = writeStream(&job, &in, chipSize);
+    }
+    if (!quiet) {
+        fprintf(stderr, "\n");
+    }
+    if (result == 0 && format != FORMAT_BINARY) {
+        info("Written %i bytes in %i ranges\n", pos, img.count);
+    }
+    // later reads of the same range are compared with the written data
+    if (current) {
+        current->written = (result == 0 && data != NULL && bankCount == 0);
+        if (current->written) {
+            current->wrStart = rwOffset;
+            current->wrLen = dataSize;
+            current->wrCrc = crcUpdate(0xFFFFFFFF, data, dataSize) ^ 0xFFFFFFFF;
+        }
+    }
+
+    if (result == 0 && verifyWrite) {
+        info("Verify OK\n");
+    }
+    // the journal is kept only for an interrupted write
+    if (job.journal[0]) {
+        if (result == 0) {
+            remove(job.journal);
+        } else {
+            info("Written %u of %u bytes, run the same command with -resume to continue\n", job.done, job.total);
+        }
+    }
+
+cleanup:
+    if (in.fd >= 0) {
+        inputClose(&in);
+    }
+    if (in2.fd >= 0) {
+        inputClose(&in2);
+    }
+    free(merged);
+    freeSparseImage(&img);
+    return result;
+}
+
+// prints a range found by cf840Diff()
+static void printDiff(void* user, uint32_t addr, uint32_t len)
+{
+    (*(int*) user)++;
+    printf("0x%06x-0x%06x (%u bytes)\n", addr, addr + len - 1, len);
+}
+
+/**
+ * Compares the chip with the -diff file and prints the differing ranges.
+ * Returns 0 when the chip matches the file.
+ */
+static int diffFlash(Cf840Device* dev)
+{
+    InputFile in;
+    SparseImage img;
+    uint8_t* data = NULL;
+    uint32_t size = 0;
+    int format = getFileFormat(fname);
+    int ranges = 0;
+    int total = 0;
+    int ret = 0;
+    int i;
+
+    // nothing is loaded when the chip can't be compared anyway
+    if (!(cf840GetCapabilities(dev)->caps & CF840_CAP_CHECKSUM)) {
+        printf("Error: the firmware can't sum the chip, compare it with -w F -verify or read it back\n");
+        return 1;
+    }
+    memset(&img, 0, sizeof(img));
+    in.fd = -1;
+    if (format == FORMAT_BINARY) {
+        ret = inputOpen(&in, fname);
+        if (ret == 0) {
+            data = inputLoad(&in, &size);
+            ret = data ? 0 : -1;
+        }
+        if (rwLength && size > rwLength) {
+            size = rwLength;
+        }
+    } else {
+        ret = loadSparseImage(&img, fname, format);
+        if (rwOffset || rwLength) {
+            printf("Error: -ofs and -len can be used only with binary files\n");
+            ret = -2;
+        }
+    }
+    if (ret == 0 && rwOffset + size > MAX_CHIP_SIZE) {
+        printf("Error: file %s does not fit into the chip\n", fname);
+        ret = -2;
+    }
+    if (ret == -1) {
+        printf("Error: failed to load file: %s\n", fname);
+    }
+
+    if (ret == 0 && data != NULL) {
+        total = cf840Diff(dev, rwOffset, data, size, printDiff, &ranges);
+    }
+    for (i = 0; ret == 0 && i < img.count && total >= 0; i++) {
+        ret = cf840Diff(dev, img.extents[i].start, img.data + img.extents[i].start, img.extents[i].len, printDiff, &ranges);
+        total = (ret < 0) ? ret : total + ret;
+        ret = 0;
+    }
+    if (!quiet) {
+        fprintf(stderr, "\n");
+    }
+    if (ret == 0 && total < 0) {
+        info("Compare failed: %s\n", cf840ErrorName(total));
+        ret = -1;
+    } else
+    if (ret == 0) {
+        info("%i bytes differ in %i ranges\n", total, ranges);
+        ret = total ? 1 : 0;
+    }
+
+    if (in.fd >= 0) {
+        inputClose(&in);
+    }
+    freeSparseImage(&img);
+    return ret ? 1 : 0;
+}
+
+// writes the whole staging buffer out
+static int outputFlush(OutputFile* o)
+{
+    uint32_t pos = 0;
+    while (pos < o->len) {
+        int ret = write(o->fd, o->buf + pos, o->len - pos);
+        if (ret <= 0) {
+            if (!atomic_load(&o->error)) {
+                info("\nError: failed to write the output data: %s\n", strerror(errno));
+            }
+            atomic_store(&o->error, 1);
+            o->len = 0;
+            return -1;
+        }
+        pos += ret;
+    }
+    o->len = 0;
+    return 0;
+}
+
+// opens the output file (or uses stdout) and reserves space for 'size' bytes
+static int outputOpen(OutputFile* o, const char* name, uint32_t size)
+{
+    if (name[0] == 0) {
+        o->fd = STDOUT_FILENO;
+    } else {
+        o->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (o->fd < 0) {
+            printf("Error: failed to open file: %s\n", name);
+            return -1;
+        }
+        // preallocate the file, so the file system does not need to grow it chunk by chunk
+        if (ftruncate(o->fd, size)) {
+            info("failed to preallocate the output file\n");
+        }
+    }
+    o->len = 0;
+    o->crc = 0xFFFFFFFF;
+    atomic_store(&o->error, 0);
+    return 0;
+}
+
+// Returns the location where the next 'len' bytes of the read data should be placed.
+// The data are directly received to the staging buffer to avoid copying.
+// A failed write is kept in 'error' and reported by outputClose().
+static uint8_t* outputReserve(OutputFile* o, uint32_t len)
+{
+    if (o->len + len > OUT_BUF_SIZE) {
+        outputFlush(o);
+    }
+    return o->buf + o->len;
+}
+
+// confirms the 'len' bytes placed to the location returned by outputReserve()
+static void outputCommit(OutputFile* o, uint32_t len)
+{
+    o->crc = crcUpdate(o->crc, o->buf + o->len, len);
+    o->len += len;
+}
+
+// returns -1 if any write of the output failed
+static int outputClose(OutputFile* o, const char* name, uint32_t size)
+{
+    outputFlush(o);
+    if (o->fd != STDOUT_FILENO && close(o->fd) && !atomic_load(&o->error)) {
+        info("Error: failed to write the output data: %s\n", strerror(errno));
+        atomic_store(&o->error, 1);
+    }
+    o->fd = -1;
+    if (atomic_load(&o->error)) {
+        return -1;
+    }
+    info("CRC32: 0x%08X  size: %u bytes %s\n", o->crc ^ 0xFFFFFFFF, size, name);
+    return 0;
+}
+
+// translates the position in the read data to the chip address (see -banks)
+static uint32_t getChipPos(uint32_t pos, uint32_t total)
+{
+    uint32_t bankSize;
+    int bank, i;
+
+    if (bankCount == 0) {
+        return pos;
+    }
+    bankSize = total / bankCount;
+    bank = pos / bankSize;
+    for (i = 0; bankOrder[i] != bank; i++);
+    return i * bankSize + (pos % bankSize);
+}
 
-            if (size > 0) {
-                //dumpBuffer(outBuf, size);
-                int ret = sendControlTransfer(h, COMMAND_WRITE, addr, bank | slowWrite , 64);
-                info("Write chunk result=%i (%s) %i addr=%04x bank=%02x \r", ret, ret == 64 ? "OK" : "Failed", pos, addr, bank);
+/**
+ * Worker of the read: swaps and splits the read data, computes the CRC
+ * and writes the output files.
+ */
+static void* outputWorker(void* arg)
+{
+    Pipeline* pipe = (Pipeline*) arg;
+    int split = (oname2[0] != 0);
+    Block* b;
+
+    devLabel = pipe->label;
+    while ((b = ringWait(pipe, &pipe->full, 1)) != NULL && b->len) {
+        if (swapBytes) {
+            swapWordBytes(b->buf, b->len);
+        }
+        if (split) {
+            deinterleave(outputReserve(&outFiles[0], b->len / 2), outputReserve(&outFiles[1], b->len / 2), b->buf, b->len / 2);
+            outputCommit(&outFiles[0], b->len / 2);
+            outputCommit(&outFiles[1], b->len / 2);
+        } else {
+            memcpy(outputReserve(&outFiles[0], b->len), b->buf, b->len);
+            outputCommit(&outFiles[0], b->len);
+        }
+        ringPush(&pipe->empty, b);
+        pipeProgress(pipe);
+    }
+    return NULL;
+}
+
+/**
+ * Reads a flash IC contents and outputs it on the standard output
+ * or to a file specified by the -o parameter. The USB transfers run on this
+ * thread, the output is written by the worker of the pipeline.
+ */
+static int readFlash(Cf840Device* dev)
+{
+    Pipeline* pipe;
+    Block* b;
+    uint32_t len;
+    uint32_t pos = 0;
+    uint32_t chipPos;
+    uint32_t total = rwLength ? rwLength : totalRead * 64;
+    uint32_t bankSize;
+    int split = (oname2[0] != 0);
+    int ret;
+    int result = 0;
+
+    if (split && (oname[0] == 0 || (total & 1))) {
+        printf("Error: -o2 requires -o and an even number of bytes\n");
+        return 1;
+    }
+    if (swapBytes && (total & 1)) {
+        printf("Error: -swap requires an even number of bytes\n");
+        return 1;
+    }
+    if (rwOffset + total > MAX_CHIP_SIZE) {
+        printf("Error: reading beyond the end of the chip\n");
+        return 1;
+    }
+    if (checkBankSize(total)) {
+        return 1;
+    }
+    if (outputOpen(&outFiles[0], oname, split ? total / 2 : total)) {
+        return 1;
+    }
+    if (split && outputOpen(&outFiles[1], oname2, total / 2)) {
+        outputClose(&outFiles[0], oname, 0);
+        return 1;
+    }
+    bankSize = bankCount ? total / bankCount : total;
+
+    pipe = pipeStart(outputWorker, NULL);
+    if (pipe == NULL) {
+        outputClose(&outFiles[0], oname, 0);
+        if (split) {
+            outputClose(&outFiles[1], oname2, 0);
+        }
+        return 1;
+    }
+    // a failed output (full disk, closed pipe) stops the read
+    while (pos < total && !atomic_load(&outFiles[0].error) && !(split && atomic_load(&outFiles[1].error))) {
+        // spans of up to 4 kbytes, each inside one (reordered) bank
+        len = (total - pos < IN_BUF_SIZE) ? total - pos : IN_BUF_SIZE;
+        if (len > bankSize - (pos % bankSize)) {
+            len = bankSize - (pos % bankSize);
+        }
+        chipPos = rwOffset + getChipPos(pos, total);
+
+// reading of data from the flash chip to the MCU takes ~ 5.3 seconds
+// raw transfer of 1 MByte takes ~ 8 seconds, that is 128kb /s - speed is 1 MBit/s
+// USB 1.1 full speed is 12 MBits / sec. Try using BULK endpoints ?
+
+        b = ringWait(pipe, &pipe->empty, 0);
+        ret = cf840Read(dev, chipPos, b->buf, len);
+        if (ret) {
+            info("\nError: %s at address 0x%06x\n", cf840ErrorName(ret), chipPos);
+            result = 1;
+        }
+        b->pos = pos;
+        b->len = len;
+        ringPush(&pipe->full, b);
+        pos += len;
+    }
+    // an empty block ends the output
+    b = ringWait(pipe, &pipe->empty, 0);
+    b->len = 0;
+    ringPush(&pipe->full, b);
+    pipeStop(pipe, 0);
+    info("\n");
+    if (outputClose(&outFiles[0], oname, split ? pos / 2 : pos)) {
+        result = 1;
+    }
+    if (split && outputClose(&outFiles[1], oname2, pos / 2)) {
+        result = 1;
+    }
+    // compare with the data written earlier in the session
+    if (current && current->written && !split && !swapBytes && bankCount == 0 &&
+        current->wrStart == rwOffset && current->wrLen == pos
+    ) {
+        int same = (outFiles[0].crc ^ 0xFFFFFFFF) == current->wrCrc;
+        info("the data %s the data written in this session\n", same ? "match" : "DO NOT match");
+        if (!same) {
+            result = 1;
+        }
+    }
+
+    return result;
+}
+
+// Source side of the copy, see copyFlash()
+typedef struct {
+    Programmer* src;
+    uint32_t end;
+} CopyJob;
+
+// Checksums of the 64 kbyte blocks of a range of a chip
+typedef struct {
+    Programmer* p;
+    uint32_t addr;
+    uint32_t len;
+    int result;
+    uint32_t sums[MAX_CHIP_SIZE >> 16];
+} ChecksumJob;
+
+/**
+ * Worker of the copy: reads the source chip into the blocks. The source
+ * runs its USB transfers here, the destination on the calling thread.
+ */
+static void* copyWorker(void* arg)
+{
+    Pipeline* pipe = (Pipeline*) arg;
+    CopyJob* job = (CopyJob*) pipe->user;
+    uint32_t pos = rwOffset;
+    Block* b;
+    int ret = CF840_OK;
+
+    devLabel = pipe->label;
+    current = job->src;
+    while ((b = ringWait(pipe, &pipe->empty, 1)) != NULL) {
+        uint32_t len = (job->end - pos < IN_BUF_SIZE) ? job->end - pos : IN_BUF_SIZE;
+        if (len) {
+            ret = cf840Read(job->src->dev, pos, b->buf, len);
+        }
+        if (ret) {
+            info("\nError: %s reading the source at address 0x%06x\n", cf840ErrorName(ret), pos);
+        }
+        b->pos = pos;
+        b->len = ret ? 0 : len;
+        b->error = (ret != CF840_OK);
+        ringPush(&pipe->full, b);
+        if (b->len == 0) {
+            break;
+        }
+        pos += len;
+        pipeProgress(pipe);
+    }
+    // the destination still writes the queued blocks: keep printing the progress
+    while (b != NULL && !atomic_load(&pipe->stop)) {
+        pipeProgress(pipe);
+        usleep(20 * 1000);
+    }
+    return NULL;
+}
+
+// sums the range of the chip in 64 kbyte blocks (the first and last may be shorter)
+static void* checksumWorker(void* arg)
+{
+    ChecksumJob* job = (ChecksumJob*) arg;
+    uint32_t pos = job->addr;
+    uint32_t end = job->addr + job->len;
+    int i = 0;
+
+    job->result = CF840_OK;
+    while (pos < end && job->result == CF840_OK) {
+        uint32_t next = (pos | 0xFFFF) + 1;
+        if (next > end) {
+            next = end;
+        }
+        job->result = cf840Checksum(job->p->dev, pos, next - pos, &job->sums[i++]);
+        pos = next;
+    }
+    return NULL;
+}
+
+/**
+ * Compares the copied range of the two chips. Both programmers sum their
+ * chip at the same time, only the checksums travel over USB.
+ */
+static int copyVerify(Programmer* src, Programmer* dst, uint32_t addr, uint32_t len)
+{
+    ChecksumJob* jobs;
+    pthread_t thread;
+    uint32_t pos = addr;
+    int started;
+    int result = 0;
+    int i = 0;
+
+    if (!(cf840GetCapabilities(src->dev)->caps & CF840_CAP_CHECKSUM) ||
+        !(cf840GetCapabilities(dst->dev)->caps & CF840_CAP_CHECKSUM)
+    ) {
+        info("Warning: the firmware can't sum the chips, the copy is not verified\n");
+        return 0;
+    }
+    if ((cf840GetCapabilities(src->dev)->caps & CF840_CAP_CRC) != (cf840GetCapabilities(dst->dev)->caps & CF840_CAP_CRC)) {
+        info("Warning: the firmware versions sum the chips differently, the copy is not verified\n");
+        return 0;
+    }
+    jobs = calloc(2, sizeof(ChecksumJob));
+    if (jobs == NULL) {
+        info("Error: out of memory\n");
+        return -1;
+    }
+    jobs[0].p = src;
+    jobs[1].p = dst;
+    for (i = 0; i < 2; i++) {
+        jobs[i].addr = addr;
+        jobs[i].len = len;
+    }
+    started = (pthread_create(&thread, NULL, checksumWorker, &jobs[0]) == 0);
+    if (!started) {
+        checksumWorker(&jobs[0]);
+    }
+    checksumWorker(&jobs[1]);
+    if (started) {
+        pthread_join(thread, NULL);
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (jobs[i].result) {
+            info("Verify of the %s failed: %s\n", i ? "destination" : "source", cf840ErrorName(jobs[i].result));
+            result = -1;
+        }
+    }
+    for (i = 0; jobs[0].result == 0 && jobs[1].result == 0 && pos < addr + len; i++) {
+        uint32_t next = (pos | 0xFFFF) + 1;
+        if (next > addr + len) {
+            next = addr + len;
+        }
+        if (jobs[0].sums[i] != jobs[1].sums[i]) {
+            info("Verify failed: the chips differ in the range 0x%06x-0x%06x\n", pos, next - 1);
+            result = 1;
+        }
+        pos = next;
+    }
+    if (result == 0) {
+        info("Verify OK\n");
+    }
+    free(jobs);
+    return result ? -1 : 0;
+}
+
+/**
+ * Copies the source chip to the destination chip. The source is read by
+ * the worker of the pipeline while the destination writes the blocks read
+ * so far, so the copy takes about as long as the slower of the two.
+ */
+static int copyFlash(Programmer* src, Programmer* dst)
+{
+    const Cf840ChipInfo* chip;
+    uint32_t srcSize;
+    uint32_t chipSize;
+    CopyJob copy;
+    WriteJob job;
+    Pipeline* pipe;
+    Block* b;
+    struct timeval t0, t1;
+    int result = 0;
+
+    current = src;
+    chip = getChip(src->dev);
+    if (chip == NULL && rwLength == 0) {
+        printf("Error: the source chip is unknown, use -len\n");
+        return -1;
+    }
+    srcSize = chip ? chip->size : MAX_CHIP_SIZE;
+    copy.src = src;
+    copy.end = rwLength ? rwOffset + rwLength : srcSize;
+    current = dst;
+    chip = getChip(dst->dev);
+    chipSize = chip ? chip->size : MAX_CHIP_SIZE;
+    // -ofs and -len must fit into both chips
+    if (rwOffset >= copy.end || copy.end > srcSize || copy.end > chipSize) {
+        printf("Error: the range 0x%06x-0x%06x does not fit into the chips\n", rwOffset, copy.end - 1);
+        return -1;
+    }
+    if (eraseSectors && chip == NULL) {
+        printf("Error: sector layout of the destination chip is unknown, can't use -esec\n");
+        return -1;
+    }
+    info("Copying %u bytes from %s to %s\n", copy.end - rwOffset, src->path, dst->path);
+
+    memset(&job, 0, sizeof(job));
+    job.dev = dst->dev;
+    job.flags = (slowWrite ? CF840_WRITE_SLOW : 0) | (eraseSectors ? CF840_WRITE_ERASE : 0) |
+        (rleEnabled(dst->dev, CF840_CAP_RLE_WRITE) ? CF840_WRITE_RLE : 0);
+    // only the destination prints its progress
+    cf840SetProgress(src->dev, NULL, NULL);
+    dst->written = 0;
+
+    gettimeofday(&t0, NULL);
+    pipe = pipeStart(copyWorker, &copy);
+    if (pipe == NULL) {
+        return -1;
+    }
+    while (1) {
+        b = ringWait(pipe, &pipe->full, 0);
+        if (b->len == 0) {
+            result = b->error ? -1 : 0;
+            break;
+        }
+        if (writeExtent(&job, b->buf, b->pos, b->len)) {
+            result = -1;
+            break;
+        }
+        ringPush(&pipe->empty, b);
+    }
+    pipeStop(pipe, 0);
+    gettimeofday(&t1, NULL);
+    if (!quiet) {
+        fprintf(stderr, "\n");
+    }
+    if (result == 0) {
+        double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+        info("Copied %u bytes in %.1f s\n", job.done, seconds);
+        result = copyVerify(src, dst, rwOffset, copy.end - rwOffset);
+    }
+    return result;
+}
+
+/**
+ * Identifies the chip, verifies the sector protection or erases
+ * the flash chip contents here.
+ */
+int runSetupCommand(Cf840Device* dev)
+{
+    int ret;
+    uint32_t pos = (setupAddrBank << 16) | setupAddr;
+    uint8_t status;
+
+    if (data == SETUP_IDENTIFY) {
+        return runIdentifyFlashChip(dev);
+    }
+
+    // verify sector protect or sector erase
+    if (data == SETUP_VERIFY_PROTECT  || data == SETUP_SECTOR_ERASE) {
+        printf("sector addr=%04x bank=%2x\n", setupAddr, setupAddrBank);
+    }
+    if (data == SETUP_VERIFY_PROTECT) {
+        ret = cf840SectorProtect(dev, pos, &status);
+        if (ret == CF840_OK) {
+            info("Sector protect status: 0x%02x\n", status);
+        }
+    } else {
+        if (current) {
+            current->written = 0;
+        }
+        printf("Erasing %s ...\n", data == SETUP_SECTOR_ERASE ? "sector": "full chip");
+        ret = (data == SETUP_SECTOR_ERASE) ? cf840EraseSector(dev, pos) : cf840EraseChip(dev);
+        printf(ret == CF840_OK ? "done\n" : "failed\n");
+    }
+    if (ret != CF840_OK) {
+        info("%s\n", cf840ErrorName(ret));
+        return 1;
+    }
+    return 0;
+}
+
+// applies the options of the step to the programmer
+static void setupProgrammer(Programmer* p)
+{
+    cf840SetProgress(p->dev, showProgress, NULL);
+    cf840SetFeatures(p->dev, rleEnabled(p->dev, CF840_CAP_RLE_READ) ? CF840_FEATURE_RLE_READ : 0);
+    cf840SetTimeout(p->dev, usbTimeout);
+    cf840SetTiming(p->dev, recordTiming, p);
+    p->sampleCnt = 0;
+}
+
+/**
+ * Copies the chip of the -copy source programmer to the destination one.
+ */
+static int runCopy(Programmer* list, int cnt)
+{
+    Programmer* src = NULL;
+    Programmer* dst = NULL;
+    int ret;
+    int i;
 
-                //usleep(1300 * 1000);
-                if (0 != waitForFlashIoFinish(h, 1000, 100, 1)) {
-                    info("\nError writing to flash at address=0x%06x \n", pos);
-                    result = -1;
-                    break;
-                }
-                pos += size;
-                addr = pos & 0xFFFF; //16 bit base address
-                bank = (pos >> 16) & 0xFF; // 4 bit top address bank
-            }
+    for (i = 0; i < cnt; i++) {
+        if (programmerMatches(&list[i], copySrc)) {
+            src = &list[i];
         }
-        printf("\n");
-        index = SETUP_READY << 8;
-        // setup for Ready - set WE high
-        ret = sendControlTransfer(h, COMMAND_SETUP, 0, index, 0);
-        if (verbose) {
-            info("Init cmd result=%i\n", ret);
+        if (programmerMatches(&list[i], copyDst)) {
+            dst = &list[i];
         }
-        fclose(f);
-
-    } else {
-        printf("Error: failed to open file: %s\n", fname);
-        return -1;
     }
-    return result;    
+    if (src == NULL || dst == NULL) {
+        fatal("programmer %s not found\n", src ? copyDst : copySrc);
+    }
+    if (src == dst) {
+        fatal("-copy: the source and the destination are the same programmer\n");
+    }
+    setupProgrammer(src);
+    setupProgrammer(dst);
+    ret = copyFlash(src, dst);
+    current = NULL;
+    saveTimings(dst);
+    return ret;
 }
 
 /**
- * Reads a flash IC contents and outputs it on the standard output.
+ * Runs the selected action on the programmer. Returns 0 on success.
  */
-static void readFlash (libusb_device_handle* h) 
+static int runAction(Programmer* p)
 {
-    int i,j;
-    uint16_t addr = 0;
-    uint16_t bank = 0;
-    uint16_t len = 64;
-    uint32_t pos = 0;
-    uint16_t index = SETUP_READ << 8;
+    Cf840Device* dev = p->dev;
+    int ret = 0;
 
-    // setup for Read
-    int ret = sendControlTransfer(h, COMMAND_SETUP, 0, index, 0);
-    if (verbose) {
-        info("Init cmd result=%i\n", ret);
+    current = p;
+    setupProgrammer(p);
+    switch(action) {
+        case COMMAND_SET_SHREG : {
+            ret = cf840Command(dev, COMMAND_SET_SHREG, srData1, 0);
+            info("Set control register data (0x%02x) result=%i\n", srData1, ret);
+        } break;
+        case COMMAND_SET_ADDR : {
+            ret = cf840Command(dev, COMMAND_SET_ADDR, (uint16_t)(addr & 0xFFFF), (uint16_t)((addr >> 16) & 0xF));
+            info("Set addr (0x%05x) result=%i\n", addr, ret);
+        } break;
+        case COMMAND_SET_DATA : {
+            ret = cf840Command(dev, COMMAND_SET_DATA, data, 0);
+            info("Set data (0x%02x) result=%i\n", data, ret);
+        } break;
+        case COMMAND_GET_DATA : {
+            ret = commandGetData(dev);
+        } break;
+        case COMMAND_SCRIPT : {
+            ret = runScript(dev);
+        } break;
+
+        case COMMAND_WRITE : {
+            ret = writeFlash(dev);
+        } break;
+
+        case COMMAND_READ : {
+            ret = readFlash(dev);
+        } break;
+
+        case ACTION_DIFF : {
+            ret = diffFlash(dev);
+        } break;
+
+        case ACTION_SELF_TEST : {
+            ret = runSelfTest(dev);
+        } break;
+
+        case COMMAND_SETUP : {
+            ret = runSetupCommand(dev);
+        } break;
+        case COMMAND_JUMP_TO_BOOTLOADER : {
+            cf840Command(dev, COMMAND_JUMP_TO_BOOTLOADER, 0, 0);
+        } break;
+    } //end of switch
+    saveTimings(p);
+    return ret;
+}
+
+// gang mode worker: runs the action on one programmer
+static void* gangWorker(void* arg)
+{
+    Programmer* p = (Programmer*) arg;
+    struct timeval t0, t1;
+
+    devLabel = p->path;
+    gettimeofday(&t0, NULL);
+    p->result = runAction(p);
+    gettimeofday(&t1, NULL);
+    p->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+    return NULL;
+}
+
+/**
+ * Runs the action on all the programmers concurrently, each from its own
+ * thread. The boards share the USB bus, but most of the time is spent waiting
+ * for the flash chips. Returns the number of the failed programmers.
+ */
+static int runGang(Programmer** list, int cnt)
+{
+    int failed = 0;
+    int i;
+
+    info("gang: %i programmers\n", cnt);
+    for (i = 0; i < cnt; i++) {
+        if (pthread_create(&list[i]->thread, NULL, gangWorker, list[i])) {
+            info("[%s] can not start the thread\n", list[i]->path);
+            list[i]->result = -1;
+            list[i]->thread = 0;
+        }
     }
-    usleep(50);
+    for (i = 0; i < cnt; i++) {
+        if (list[i]->thread) {
+            pthread_join(list[i]->thread, NULL);
+        }
+    }
+    for (i = 0; i < cnt; i++) {
+        info("%-12s serial=%s %s (%.1f s)\n", list[i]->path, list[i]->serial,
+            list[i]->result ? "FAILED" : "OK", list[i]->seconds);
+        if (list[i]->result) {
+            failed++;
+        }
+    }
+    return failed;
+}
 
-    while (i < totalRead) {
-        i++;
-        addr = pos & 0xFFFF; //16 bit base address
-        bank = (pos >> 16) & 0xFF; //4 bit top address
+/**
+ * Runs the job described by the parsed arguments on the open programmers.
+ * Returns 0 on success.
+ */
+static int runJob(Programmer* list, int cnt)
+{
+    Programmer* sel[MAX_DEVICES];
+    int selCnt = 0;
+    int i;
 
-        // initiates reading
-        ret = sendControlTransfer(h, COMMAND_READ, addr, bank, 0);
-        if (ret != 0) {
-            info("Read set addr failed. result=%i\n", ret); 
+    if (action == ACTION_LIST_DEVICES) {
+        for (i = 0; i < cnt; i++) {
+            const Cf840Capabilities* caps = cf840GetCapabilities(list[i].dev);
+            printf("%-12s serial=%s ", list[i].path, list[i].serial);
+            if (caps->protocol) {
+                printf("firmware=%i.%i caps=0x%04x\n", caps->version >> 8, caps->version & 0xFF, caps->caps);
+            } else {
+                printf("firmware=legacy\n");
+            }
+        }
+        return 0;
+    }
+    if (action == ACTION_TIMINGS) {
+        return printTimings();
+    }
+    if (action == ACTION_COPY) {
+        return runCopy(list, cnt);
+    }
+    for (i = 0; i < cnt; i++) {
+        if (programmerSelected(&list[i])) {
+            sel[selCnt++] = &list[i];
         }
-        info("Read chunk result=%i (%s) %i addr=%04x bank=%02x \r", ret, ret == 0 ? "OK" : "Failed", pos, addr, bank);
+    }
+    if (selCnt == 0) {
+        fatal(devSelect[0] ? "programmer %s not found\n" : "programmer device not found\n", devSelect);
+    }
+    if (selCnt > 1 && !gang) {
+        fatal("%i programmers found: use -dev or -gang\n", selCnt);
+    }
+    if (gang) {
+        return runGang(sel, selCnt);
+    }
+    return runAction(sel[0]);
+}
 
-        //wait until the buffer is filled
-        waitForFlashIoFinish(h, 50, 20, 0);
-        //usleep(2000);
+static char* stepArgs[4096];
+static char batchText[64 * 1024];
+static int batchTextLen = 0;
 
-// reading of data from the flash chip to the MCU takes ~ 5.3 seconds
-// set to 0 to test speeds (raw transfer of 1 MByte takes ~ 8 seconds, that is 128kb /s - speed is 1 MBit/s)
-// USB 1.1 full speed is 12 MBits / sec. Try using BULK endpoints ?
-#if 1
-        // transfers the buffer with data
-        ret = recvControlTransfer(h, COMMAND_READ | 1, addr, bank);
-        if (ret != len) {
-            info("Get data failed. result=%i\n", ret); 
-        } else {
-            //info("Data read: 0x%02x  status: 0x%02x\n", resBuf[0], resBuf[1]); 
+/**
+ * Reads the steps from the batch file: one step per line, the arguments are
+ * separated by spaces (use quotes for names with spaces), # starts a comment.
+ */
+static int loadBatch(const char* name, Step* steps, int stepCnt, int* argCnt)
+{
+    FILE* f = fopen(name, "r");
+    char line[1024];
+
+    if (f == NULL) {
+        fatal("-batch: can not open file %s\n", name);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* s = line;
+        int started = 0;
+        while (1) {
+            char* arg;
+            while (*s && isspace((unsigned char) *s)) {
+                s++;
+            }
+            if (*s == 0 || *s == '#') {
+                break;
+            }
+            if (!started) {
+                if (stepCnt >= MAX_STEPS || *argCnt >= 4090) {
+                    fatal("-batch: too many steps\n");
+                }
+                steps[stepCnt].argv = &stepArgs[*argCnt];
+                steps[stepCnt].argc = 1;
+                stepArgs[(*argCnt)++] = "prog_pc";
+                stepCnt++;
+                started = 1;
+            }
+            arg = batchText + batchTextLen;
+            if (*s == '"') {
+                s++;
+                while (*s && *s != '"' && batchTextLen < sizeof(batchText) - 1) {
+                    batchText[batchTextLen++] = *s++;
+                }
+                if (*s == '"') {
+                    s++;
+                }
+            } else {
+                while (*s && !isspace((unsigned char) *s) && batchTextLen < sizeof(batchText) - 1) {
+                    batchText[batchTextLen++] = *s++;
+                }
+            }
+            if (batchTextLen >= sizeof(batchText) - 1 || *argCnt >= 4090) {
+                fatal("-batch: the file %s is too long\n", name);
+            }
+            batchText[batchTextLen++] = 0;
+            stepArgs[(*argCnt)++] = arg;
+            steps[stepCnt - 1].argc++;
         }
-        //dumpBuffer(resBuf, sizeof(resBuf));
-        for (j = 0; j < 64; j++) putc(resBuf[j], stdout);
-#endif
-        pos += 64;
     }
-    info("\n");
+    fclose(f);
+    return stepCnt;
+}
 
-    index = SETUP_READY << 8;
+/**
+ * Splits the arguments into the steps of a session. The steps are separated
+ * by '+' and '-batch F' adds the steps from the file F.
+ * Returns the number of steps.
+ */
+static int parseSteps(int argc, char** argv, Step* steps)
+{
+    int stepCnt = 1;
+    int argCnt = 0;
+    int i;
 
-    // setup for Ready - set OE high
-    ret = sendControlTransfer(h, COMMAND_SETUP, 0, index, 0);
-    if (verbose) {
-        info("Init cmd result=%i\n", ret);
+    batchTextLen = 0;
+    steps[0].argv = &stepArgs[0];
+    steps[0].argc = 1;
+    stepArgs[argCnt++] = argv[0];
+    for (i = 1; i < argc; i++) {
+        if (strcmp("+", argv[i]) == 0 || strcmp("-batch", argv[i]) == 0) {
+            if (strcmp("-batch", argv[i]) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-batch: missing file name\n");
+                stepCnt = loadBatch(argv[++i], steps, stepCnt, &argCnt);
+            }
+            // the following arguments start a new step
+            if (stepCnt >= MAX_STEPS || argCnt >= 4090) {
+                fatal("too many steps\n");
+            }
+            steps[stepCnt].argv = &stepArgs[argCnt];
+            steps[stepCnt].argc = 1;
+            stepArgs[argCnt++] = argv[0];
+            stepCnt++;
+            continue;
+        }
+        if (argCnt >= 4090) {
+            fatal("too many arguments\n");
+        }
+        stepArgs[argCnt++] = argv[i];
+        steps[stepCnt - 1].argc++;
     }
-    usleep(50);
+    // the first step sets up the session: parse it for the caller
+    batchStep = 0;
+    checkArguments(steps[0].argc, steps[0].argv);
+    return stepCnt;
 }
 
 /**
- * Retrieves data and status bytes from the flash IC.
+ * Runs the steps of the session one after another on the same programmers.
+ * Steps without an action only change the options of the session.
+ * Stops at the first failed step. Returns 0 on success.
  */
-static int commandGetData(libusb_device_handle* h, char printResult)
+static int runSteps(Programmer* list, int cnt, Step* steps, int stepCnt)
 {
-    int ret = recvControlTransfer(h, COMMAND_GET_DATA, 0, 0);
-    if (ret != 2) {
-        info("Get data failed. result=%i\n", ret); 
-    } else {
-        if (printResult) {
-            info("Data read: 0x%02x  status: 0x%02x\n", resBuf[0], resBuf[1]);
-        } else {
-            ret = 0;
+    int ret = 0;
+    int run = 0;
+    int i;
+
+    // the daemon keeps the programmers: the chip may have been replaced since the last job
+    for (i = 0; i < cnt; i++) {
+        list[i].chipKnown = 0;
+        list[i].written = 0;
+    }
+    for (i = 0; i < stepCnt && ret == 0; i++) {
+        batchStep = i;
+        checkArguments(steps[i].argc, steps[i].argv);
+        if (action == ACTION_PRINT_HELP) {
+            usage();
+        }
+        if (action == ACTION_DAEMON) {
+            fatal("-daemon can't be a step of a session\n");
         }
+        if (action == 0) {
+            continue;
+        }
+        if (stepCnt > 1) {
+            info("step %i\n", ++run);
+        }
+        ret = runJob(list, cnt);
+    }
+    batchStep = 0;
+    if (stepCnt > 1 && run == 0) {
+        usage();
     }
     return ret;
 }
 
+#ifndef MINGW
+// name of the daemon socket. The default one is in a directory only the
+// user can access: /tmp is shared with the other users.
+static void getSocketName(struct sockaddr_un* sa, int create)
+{
+    const char* env = getenv("PROG_PC_SOCKET");
+    const char* runDir = getenv("XDG_RUNTIME_DIR");
+    char dir[64];
+    struct stat st;
+
+    memset(sa, 0, sizeof(struct sockaddr_un));
+    sa->sun_family = AF_UNIX;
+    // a cut name would be a different socket
+    if (sockName[0] || env != NULL) {
+        if (snprintf(sa->sun_path, sizeof(sa->sun_path), "%s", sockName[0] ? sockName : env) >= (int) sizeof(sa->sun_path)) {
+            fatal("the socket name %s is longer than %i characters\n", sockName[0] ? sockName : env, (int) sizeof(sa->sun_path) - 1);
+        }
+    } else
+    if (runDir != NULL && runDir[0]) {
+        if (snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/prog_pc.sock", runDir) >= (int) sizeof(sa->sun_path)) {
+            fatal("the socket name %s/prog_pc.sock is longer than %i characters\n", runDir, (int) sizeof(sa->sun_path) - 1);
+        }
+    } else {
+        snprintf(dir, sizeof(dir), "/tmp/prog_pc-%i", (int) getuid());
+        if (create && mkdir(dir, 0700) && errno != EEXIST) {
+            fatal("can not create the directory %s\n", dir);
+        }
+        // the directory could be created by another user
+        if (create && (lstat(dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))) {
+            fatal("%s is not a private directory of the user\n", dir);
+        }
+        snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/daemon.sock", dir);
+    }
+}
+
+// checks the process on the other end of the socket runs as the same user
+static int peerIsUser(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
 /**
- * Retrieves the vendor ID and product ID of the flash chip
+ * Connects to the daemon, returns the socket or -1 when the daemon is not
+ * running. The job hands over the standard streams: a socket or a daemon
+ * of another user is refused and the job runs locally.
  */
-static int runIdentifyFlashChip(libusb_device_handle* h)
+static int connectDaemon(void)
 {
-    int ret;
-    uint16_t addr = 0;
-    uint16_t index = 0;
-    uint8_t vendorId = 0;
-    uint8_t productId = 0;
+    struct sockaddr_un sa;
+    struct stat st;
+    int fd;
 
-    //read Vendor Id
-    ret = sendControlTransfer(h, COMMAND_SETUP, addr, index, 0);
-    if (ret != 0) {
-        info("Control transfer failed. result=%i\n", ret);
-        return ret; 
+    getSocketName(&sa, 0);
+    if (lstat(sa.sun_path, &st)) {
+        return -1;
     }
-    usleep(50 * 1000);
-    //read back the value
-    ret = commandGetData(h, 0);
-    if (ret) {
-        return ret;
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+        info("Warning: %s is not a socket of the user, not using the daemon\n", sa.sun_path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &sa, sizeof(sa))) {
+        close(fd);
+        return -1;
+    }
+    if (!peerIsUser(fd)) {
+        info("Warning: the daemon at %s runs as another user, not using it\n", sa.sun_path);
+        close(fd);
+        return -1;
     }
-    vendorId = resBuf[0];
+    return fd;
+}
 
-    //read Product Id
-    index = 1 << 8;
-    ret = sendControlTransfer(h, COMMAND_SETUP, addr, index, 0);
-    if (ret != 0) {
-        info("Control transfer failed. result=%i\n", ret);
-        return ret; 
+/**
+ * Submits the job to the daemon. The message is the length of the payload
+ * followed by the working directory and the arguments (zero terminated
+ * strings). The standard input, output and error are passed along with it,
+ * so the daemon reads the data and prints the progress directly.
+ * Returns the exit code of the job.
+ */
+static int runClient(int fd, int argc, char** argv)
+{
+    char payload[8192];
+    uint32_t len;
+    int fds[3] = { 0, 1, 2 };
+    char cmsgBuf[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr* cmsg;
+    int32_t result = 1;
+    int i;
+
+    if (getcwd(payload, sizeof(payload)) == NULL) {
+        fatal("can not get the working directory\n");
     }
-    usleep(50 * 1000);
-    //read back the value
-    ret = commandGetData(h, 0);
-    if (ret) {
-        return ret;
+    len = strlen(payload) + 1;
+    for (i = 1; i < argc; i++) {
+        int size = strlen(argv[i]) + 1;
+        if (len + size > sizeof(payload)) {
+            fatal("arguments are too long\n");
+        }
+        memcpy(payload + len, argv[i], size);
+        len += size;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = &len;
+    iov[0].iov_len = sizeof(len);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = sizeof(cmsgBuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, 0) != (ssize_t)(sizeof(len) + len)) {
+        fatal("can not submit the job to the daemon\n");
     }
-    productId = resBuf[0];
+    // the job writes directly to our output, only the exit code comes back
+    if (read(fd, &result, sizeof(result)) != sizeof(result)) {
+        info("the daemon closed the connection\n");
+        result = 1;
+    }
+    close(fd);
+    return result;
+}
 
-    info("VendorId: 0x%02x  ProductId: 0x%02x\n", vendorId, productId);
+// reads exactly 'len' bytes from the socket
+static int readFully(int fd, void* buf, uint32_t len)
+{
+    uint32_t pos = 0;
+    while (pos < len) {
+        ssize_t ret = read(fd, (uint8_t*) buf + pos, len - pos);
+        if (ret <= 0) {
+            return -1;
+        }
+        pos += ret;
+    }
     return 0;
 }
 
 /**
- * Sets up the Flash IC for reading , writing operations etc.
- * Also it erases the flash chip contents here.
+ * Receives one job from the client and runs it with the client's standard
+ * input and outputs. Returns the exit code of the job.
  */
-int runSetupCommand(libusb_device_handle* h)
+static int runDaemonJob(int conn, Cf840Context* c, Programmer* list, int* cnt)
 {
-    int ret;
-    uint16_t addr = 0;
-    uint16_t addrBank = 0;
-    uint16_t index = data;
+    static char payload[8192];
+    static char* args[256];
+    static Step steps[MAX_STEPS];
+    int stepCnt;
+    uint32_t len = 0;
+    int fds[3];
+    int saved[3];
+    char cmsgBuf[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    volatile int result;
+    int argc = 1;
+    int cwd;
+    int i;
 
-    if (data == SETUP_IDENTIFY) {
-        return runIdentifyFlashChip(h);
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = sizeof(cmsgBuf);
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(len)) {
+        return 1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        info("daemon: job without standard streams\n");
+        return 1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (len == 0 || len > sizeof(payload) || readFully(conn, payload, len)) {
+        info("daemon: invalid job\n");
+        for (i = 0; i < 3; i++) {
+            close(fds[i]);
+        }
+        return 1;
     }
+    payload[len - 1] = 0;
 
-    // verify sector protect or sector erase
-    if (data == SETUP_VERIFY_PROTECT  || data == SETUP_SECTOR_ERASE) {
-        addr = setupAddr;
-        addrBank = setupAddrBank; 
-        printf("sector addr=%04x bank=%2x\n", addr, addrBank);
+    // split the payload: working directory first, then the arguments
+    args[0] = "prog_pc";
+    for (i = strlen(payload) + 1; i < len && argc < 255; i += strlen(payload + i) + 1) {
+        args[argc++] = payload + i;
     }
+    args[argc] = NULL;
 
-    index <<= 8;
-    index |= addrBank;
-    ret = sendControlTransfer(h, COMMAND_SETUP, addr, index, 0);
-    if (verbose) {
-        info("Init cmd result=%i\n", ret);
+    // the job runs in the client's directory and with its standard streams
+    fflush(stdout);
+    fflush(stderr);
+    cwd = open(".", O_RDONLY);
+    for (i = 0; i < 3; i++) {
+        saved[i] = dup(i);
+        dup2(fds[i], i);
+        close(fds[i]);
     }
-    if (ret == 0) {
-        //wait for erase finished (takes ~ 5 secs for the full erase);
-        if (data == SETUP_ERASE || data == SETUP_SECTOR_ERASE) {
-            int result;
-            printf("Erasing %s ...\n", data == SETUP_SECTOR_ERASE ? "sector": "full chip");
-            result = waitForFlashIoFinish(h, 1 * 1000 * 1000, 500 * 000, 2);
-            if (0 == result) {
-                printf("done\n");
-            } else {
-                printf("failed\n");
-                ret = 1;
+
+    result = 1;
+    if (chdir(payload) == 0) {
+        atomic_store(&jobFailed, 0);
+        jobThread = pthread_self();
+        if (setjmp(jobExit) == 0) {
+            jobActive = 1;
+            stepCnt = parseSteps(argc, args, steps);
+            if ((action == 0 && stepCnt == 1) || action == ACTION_PRINT_HELP) {
+                usage();
+            }
+            if (action == ACTION_DAEMON) {
+                fatal("the daemon is already running\n");
+            }
+            cf840SetLog(c, verbose ? logLibrary : NULL, NULL);
+            if (hotplugActive) {
+                *cnt = hotplugUpdate(list, *cnt);
+            } else
+            if (*cnt == 0) {
+                // the programmers were not connected yet
+                *cnt = openProgrammers(c, list);
+            }
+            if (waitTime) {
+                *cnt = waitForProgrammers(c, list, *cnt);
             }
+            result = (runSteps(list, *cnt, steps, stepCnt) || atomic_load(&jobFailed)) ? 1 : 0;
         } else {
-            usleep(100 * 1000);
-            //read back the value
-            commandGetData(h, 1);
+            // fatal error or usage
+            result = 1;
         }
+        jobActive = 0;
+        batchStep = 0;
+    } else {
+        info("can not change the directory to %s\n", payload);
     }
-    return ret;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < 3; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    if (cwd >= 0) {
+        if (fchdir(cwd)) {
+            info("daemon: can not restore the working directory\n");
+        }
+        close(cwd);
+    }
+    return result;
 }
 
 /**
- * Main entry point.
+ * Keeps the programmers open and runs the jobs submitted by the clients,
+ * one after another.
  */
-int main(int argc, char** argv) {
-    libusb_context* c = NULL;
-    libusb_device_handle *h;
-    int offset = 0, size = 0;
-    int ret;
+static int runDaemon(Cf840Context* c)
+{
+    Programmer list[MAX_DEVICES];
+    struct sockaddr_un sa;
+    mode_t mask;
+    int cnt;
+    int fd;
     int i;
 
-    checkArguments(argc, argv);
-    if (action == 0 || action == ACTION_PRINT_HELP) {
-        usage();
+    fd = connectDaemon();
+    if (fd >= 0) {
+        close(fd);
+        fatal("the daemon is already running\n");
     }
-
-    //initialize libusb 
-    if (libusb_init(&c)) {
-        fatal("can not initialise libusb\n");
+    getSocketName(&sa, 1);
+    unlink(sa.sun_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // only the owner may submit the jobs
+    mask = umask(077);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &sa, sizeof(sa)) || listen(fd, 16)) {
+        fatal("can not create the socket %s\n", sa.sun_path);
     }
+    umask(mask);
+    // a client may disappear while its job is running
+    signal(SIGPIPE, SIG_IGN);
 
-    //set debugging state
-    if (debug) {
-        libusb_set_debug(c, 4);
+    // registered before the scan: no programmer is missed
+    if (hotplugStart(c)) {
+        info("daemon: hotplug is not supported, new programmers are found only when none is connected\n");
     }
+    cnt = openProgrammers(c, list);
+    info("daemon: %i programmers ready, listening on %s\n", cnt, sa.sun_path);
 
-    //get the handle of the connected USB device
-    h = getDeviceHandle(c);
-
-    //try to detach existing kernel driver if kernel is already handling 
-    //the device
-    if (libusb_kernel_driver_active(h, 0) == 1) {
-        if (verbose) {
-            info("kernel driver active\n");
+    while (1) {
+        int32_t result;
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            continue;
         }
-        if (!libusb_detach_kernel_driver(h, 0)) {
-            if (verbose) {
-                info("driver detached\n");
-            }
+        // the job gets the files of the daemon's user
+        if (!peerIsUser(conn)) {
+            info("daemon: refused a job of another user\n");
+            close(conn);
+            continue;
         }
+        result = runDaemonJob(conn, c, list, &cnt);
+        if (write(conn, &result, sizeof(result)) != sizeof(result) && verbose) {
+            info("daemon: the client is gone\n");
+        }
+        close(conn);
+    }
+    for (i = 0; i < cnt; i++) {
+        closeProgrammer(&list[i]);
     }
+    return 0;
+}
+#endif
 
+/**
+ * Main entry point.
+ */
+int main(int argc, char** argv) {
+    Cf840Context* c = NULL;
+    Programmer list[MAX_DEVICES];
+    Step steps[MAX_STEPS];
+    int stepCnt;
+    int cnt;
+    int ret;
+    int i;
 
-    //set the first configuration -> initialize USB device
-    if (libusb_set_configuration (h, 1) != 0) {
-        fatal("cannot set device configuration\n");
+    crcInit();
+    stepCnt = parseSteps(argc, argv, steps);
+    if ((action == 0 && stepCnt == 1) || action == ACTION_PRINT_HELP) {
+        usage();
+    }
+    // the report does not need the programmers
+    if (action == ACTION_TIMINGS && stepCnt == 1) {
+        return printTimings();
     }
 
-    if (verbose) {
-        info("device configuration set\n");
+#ifndef MINGW
+    // the daemon has the programmers already open
+    if (useDaemon && action != ACTION_DAEMON) {
+        int fd = connectDaemon();
+        if (fd >= 0) {
+            return runClient(fd, argc, argv);
+        }
     }
-    usleep(20 * 1000);
+#endif
 
-    //get the first interface of the USB configuration
-    if (libusb_claim_interface(h, 0) < 0) {
-         fatal("cannot claim interface\n");
+    //initialize libusb 
+    if (cf840Init(&c)) {
+        fatal("can not initialise libusb\n");
     }
 
+    //set debugging state
+    if (debug) {
+        libusb_set_debug(cf840UsbContext(c), 4);
+    }
     if (verbose) {
-        info("interface claimed\n");
+        cf840SetLog(c, logLibrary, NULL);
     }
 
-    if (libusb_set_interface_alt_setting(h, 0, 0) < 0) {
-        fatal("alt setting failed\n");
+#ifndef MINGW
+    if (action == ACTION_DAEMON) {
+        ret = runDaemon(c);
+        cf840Exit(c);
+        return ret;
     }
+#endif
 
-    switch(action) {
-        case COMMAND_SET_SHREG : {
-            int ret;
-            ret = sendControlTransfer(h, COMMAND_SET_SHREG, srData1, 0, 0);
-            info("Set control register data (0x%02x) result=%i\n", srData1, ret);
-        } break;
-        case COMMAND_SET_ADDR : {
-            int ret;
-            ret = sendControlTransfer(h, COMMAND_SET_ADDR, (uint16_t)(addr & 0xFFFF), (uint16_t)((addr >> 16) & 0xF), 0);
-            info("Set addr (0x%05x) result=%i\n", addr, ret);
-        } break;
-        case COMMAND_SET_DATA : {
-            int ret;
-            ret = sendControlTransfer(h, COMMAND_SET_DATA, data, 0, 0);
-            info("Set data (0x%02x) result=%i\n", data, ret);
-        } break;
-        case COMMAND_GET_DATA : {
-            commandGetData(h, 1);
-        } break;
-
-        case COMMAND_WRITE : {
-            writeFlash(h);
-        } break;
-
-        case COMMAND_READ : {
-            readFlash(h);
-        } break;
+    if (waitTime) {
+        hotplugStart(c);
+    }
 
-        case COMMAND_SETUP : {
-            runSetupCommand(h);
-        } break;
-        case COMMAND_JUMP_TO_BOOTLOADER : {
-            sendControlTransfer(h, COMMAND_JUMP_TO_BOOTLOADER, 0, 0, 0);
-        } break;
-    } //end of switch
+    //find the connected programmers
+    cnt = openProgrammers(c, list);
+    if (waitTime) {
+        cnt = waitForProgrammers(c, list, cnt);
+        hotplugStop(c);
+    }
+    ret = runSteps(list, cnt, steps, stepCnt);
 
-    libusb_release_interface(h, 0);
-    libusb_close(h);
-    libusb_exit(c);
-    return 0;
+    for (i = 0; i < cnt; i++) {
+        closeProgrammer(&list[i]);
+    }
+    cf840Exit(c);
+    return ret ? 1 : 0;
 }
@@ -0,0 +1,66 @@
+/**
+ * Tests of the Intel HEX and S-record loader of prog_pc: records at the end
+ * of the chip and records whose addresses wrap around 32 bits.
+ *
+ * compile_pc.sh builds and runs it after prog_pc (from the top directory).
+ */
+
+// the tested functions are static: include the whole program
+#define main progPcMain
+#include "../src/prog_pc.c"
+#undef main
+
+typedef struct {
+    const char* name;
+    int format;
+    const char* text;
+    int result;      // expected result of loadSparseImage()
+} ImageTest;
+
+static const ImageTest imageTests[] = {
+    // 2 bytes at 0xFFFFE: the last bytes of the chip
+    { "S3 last bytes", FORMAT_SREC, "S307000FFFFE1234A6\n", 0 },
+    // 2 bytes at 0xFFFFF: one byte past the end
+    { "S3 past the end", FORMAT_SREC, "S307000FFFFF1234A5\n", -1 },
+    // 2 bytes at 0xFFFFFFFF: the end address wraps to 1
+    { "S3 wrapping address", FORMAT_SREC, "S307FFFFFFFF0011EB\n", -1 },
+    // extended linear address 0xFFFF, 2 bytes at 0xFFFF: wraps to 1
+    { "ELA wrapping address", FORMAT_IHEX, ":02000004FFFFFC\n:02FFFF00AABB9B\n:00000001FF\n", -1 },
+    // extended linear address 0x000F, 2 bytes at 0xFFFE: the last bytes of the chip
+    { "ELA last bytes", FORMAT_IHEX, ":02000004000FEB\n:02FFFE00AABB9C\n:00000001FF\n", 0 },
+    // only the end of file record: nothing to write
+    { "no data records", FORMAT_IHEX, ":00000001FF\n", -1 },
+};
+
+// loads the records of a test from a temporary file
+static int runImageTest(const ImageTest* t)
+{
+    char name[] = "/tmp/image_testXXXXXX";
+    SparseImage img;
+    int fd = mkstemp(name);
+    int ret;
+
+    if (fd < 0 || write(fd, t->text, strlen(t->text)) != (int) strlen(t->text)) {
+        fatal("failed to write %s\n", name);
+    }
+    close(fd);
+    ret = loadSparseImage(&img, name, t->format);
+    freeSparseImage(&img);
+    unlink(name);
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    int failed = 0;
+    int i;
+
+    for (i = 0; i < (int) (sizeof(imageTests) / sizeof(imageTests[0])); i++) {
+        int ret = runImageTest(&imageTests[i]);
+        printf("%-24s %s\n", imageTests[i].name, ret == imageTests[i].result ? "ok" : "FAILED");
+        if (ret != imageTests[i].result) {
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}